@@ -31,6 +31,12 @@ enum {
 	/* Directory operations */
 	mtLookup, mtLink, mtUnlink, mtReaddir,
 
+	/* Kernel notifications */
+	mtRing, mtPulse,
+
+	/* Combined operations */
+	mtOpenPath, mtGetAttrAll,
+
 	mtCount
 } type;
 
@@ -72,7 +78,7 @@ typedef struct _msg_t {
 				oid_t oid;
 			} destroy;
 
-			/* SETATTR/GETATTR */
+			/* SETATTR/GETATTR/GETATTRALL */
 			struct {
 				oid_t oid;
 				int type;
@@ -84,6 +90,12 @@ typedef struct _msg_t {
 				oid_t dir;
 			} lookup;
 
+			/* OPENPATH */
+			struct {
+				oid_t dir;
+				int flags;
+			} openpath;
+
 			/* LINK/UNLINK */
 			struct {
 				oid_t dir;
@@ -96,6 +108,18 @@ typedef struct _msg_t {
 				offs_t offs;
 			} readdir;
 
+			/* RING */
+			struct {
+				unsigned int id;
+				int closed;
+			} ring;
+
+			/* PULSE */
+			struct {
+				int code;
+				int value;
+			} pulse;
+
 			unsigned char raw[64];
 		};
 
@@ -127,6 +151,16 @@ typedef struct _msg_t {
 				int err;
 			} lookup;
 
+			/* OPENPATH, err as in LOOKUP, dev is opened (and truncated) if it belongs to the server */
+			struct {
+				int err;
+				int opened;
+				int id;
+				oid_t fil;
+				oid_t dev;
+				offs_t size;
+			} openpath;
+
 			unsigned char raw[64];
 		};
 
@@ -137,6 +171,48 @@ typedef struct _msg_t {
 } msg_t;
 
 
+/* Object attributes returned by mtGetAttrAll in output buffer, valid is set by server filling them */
+typedef struct _msgattr_t {
+	int valid;
+	int mode;
+	int uid;
+	int gid;
+	int links;
+	offs_t size;
+	long long atime;
+	long long mtime;
+	long long ctime;
+} msgattr_t;
+
+
+/* Vectored payload segment */
+typedef struct _msgiov_t {
+	void *data;
+	size_t size;
+} msgiov_t;
+
+
+/* Shared submission/completion ring header, entry arrays follow at given offsets */
+typedef struct _msgring_t {
+	volatile unsigned int sqhead;
+	volatile unsigned int sqtail;
+	volatile unsigned int cqhead;
+	volatile unsigned int cqtail;
+
+	unsigned int entries;
+	unsigned int sqoffs;
+	unsigned int cqoffs;
+	unsigned int dataoffs;
+} msgring_t;
+
+
+/* Ring entry, payload pointers are offsets from the beginning of the ring */
+typedef struct _msgringent_t {
+	unsigned long long tag;
+	msg_t msg;
+} msgringent_t;
+
+
 #pragma pack(pop)
 
 
@@ -111,4 +111,18 @@
 	ID(sys_getpgrp) \
 	ID(sys_setsid) \
 	ID(sys_spawn) \
-	ID(release)
+	ID(release) \
+	ID(threadDeadline) \
+	ID(futexWait) \
+	ID(futexWake) \
+	ID(msgRespondAndRecv) \
+	ID(msgSendv) \
+	ID(msgRingSetup) \
+	ID(msgRingEnter) \
+	ID(msgRingComplete) \
+	ID(msgPulse) \
+	ID(portSetAdd) \
+	ID(portSetRemove) \
+	ID(portsinfo) \
+	ID(msgSendTimed) \
+	ID(msgRecvTimed)
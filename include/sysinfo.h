@@ -44,6 +44,32 @@ typedef struct _threadinfo_t {
 } threadinfo_t;
 
 
+#define PORT_HISTSZ 24
+
+
+typedef struct _portstats_t {
+	unsigned int received;
+	unsigned int responded;
+	unsigned int depth;
+	unsigned int maxdepth;
+
+	/* Payload bytes passed through address space mapping (or copying) and in message body */
+	unsigned long long mapped;
+	unsigned long long packed;
+
+	/* Latency in microseconds, bucket i counts values below 2^(i + 1) */
+	unsigned int recvlat[PORT_HISTSZ];
+	unsigned int resplat[PORT_HISTSZ];
+} portstats_t;
+
+
+typedef struct _portinfo_t {
+	unsigned int id;
+	unsigned int pid;
+	portstats_t stats;
+} portinfo_t;
+
+
 typedef struct _entryinfo_t {
 	void *vaddr;
 	size_t size;
@@ -90,7 +116,7 @@ typedef struct {
 } __attribute__((packed)) perf_event_t;
 
 
-enum { perf_levBegin, perf_levEnd, perf_levFork, perf_levKill, perf_levExec };
+enum { perf_levBegin, perf_levEnd, perf_levFork, perf_levKill, perf_levExec, perf_levPriority };
 
 
 typedef struct {
@@ -148,4 +174,15 @@ typedef struct {
 	char path[32];
 } __attribute__((packed)) perf_levent_exec_t;
 
+
+typedef struct {
+	unsigned sbz;
+
+	unsigned deltaTimestamp : 12;
+	unsigned type : 3;
+
+	unsigned prio : 3;
+	unsigned tid : 18;
+} __attribute__((packed)) perf_levent_priority_t;
+
 #endif
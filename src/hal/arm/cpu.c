@@ -21,6 +21,10 @@
 #include "../../../include/errno.h"
 
 
+/* TPIDRPRW holds kernel stack used on exception entry, current thread is kept in memory */
+void *hal_cpuCurrent;
+
+
 /* Function creates new cpu context on top of given thread kernel stack */
 int hal_cpuCreateContext(cpu_context_t **nctx, void *start, void *kstack, size_t kstacksz, void *ustack, void *arg)
 {
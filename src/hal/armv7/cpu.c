@@ -37,6 +37,9 @@ struct {
 volatile cpu_context_t *_cpu_nctx;
 
 
+void *hal_cpuCurrent;
+
+
 /* context management */
 
 
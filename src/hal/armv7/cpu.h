@@ -404,6 +404,24 @@ static inline unsigned int hal_cpuGetID(void)
 }
 
 
+/* per-CPU data */
+
+
+extern void *hal_cpuCurrent;
+
+
+static inline void *hal_cpuGetCurrent(void)
+{
+	return hal_cpuCurrent;
+}
+
+
+static inline void hal_cpuSetCurrent(void *current)
+{
+	hal_cpuCurrent = current;
+}
+
+
 static inline unsigned int hal_cpuGetCount(void)
 {
 	return 1;
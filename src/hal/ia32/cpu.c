@@ -31,6 +31,11 @@ struct {
 	tss_t tss;
 	u32 dr5;
 
+	/* per-CPU data area addressed by SEL_KLOCAL */
+	struct {
+		void *current;
+	} local;
+
 	spinlock_t lock;
 } cpu;
 
@@ -231,7 +236,7 @@ int hal_cpuCreateContext(cpu_context_t **nctx, void *start, void *kstack, size_t
 	ctx->ecx = 0;
 	ctx->ebx = 0;
 	ctx->eax = 0;
-	ctx->gs = ustack ? SEL_UDATA : SEL_KDATA;
+	ctx->gs = ustack ? SEL_UDATA : SEL_KLOCAL;
 	ctx->fs = ustack ? SEL_UDATA : SEL_KDATA;
 	ctx->es = ustack ? SEL_UDATA : SEL_KDATA;
 	ctx->ds = ustack ? SEL_UDATA : SEL_KDATA;
@@ -370,6 +375,17 @@ cpu.tss.esp0 = (u32)&s;
 		movl $40, %%eax; \
 		ltr %%ax"
 	::);
+
+	/* Prepare per-CPU data segment */
+	cpu.local.current = NULL;
+	_cpu_gdtInsert(6, (u32)&cpu.local, sizeof(cpu.local), DESCR_KLOCAL);
+
+	__asm__ volatile (" \
+		movl %0, %%eax; \
+		movw %%ax, %%gs"
+	:
+	:"i" (SEL_KLOCAL)
+	:"eax", "memory");
 }
 
 
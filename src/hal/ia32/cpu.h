@@ -83,12 +83,16 @@
 /* Descriptor of user task data segment */
 #define DESCR_KDATA  (DBITS_4KB | DBITS_PRESENT | DBITS_DPL0 | DBITS_APP | DBITS_DATA | DBITS_WRT)
 
+/* Descriptor of kernel per-CPU data segment */
+#define DESCR_KLOCAL (DBITS_1B | DBITS_PRESENT | DBITS_DPL0 | DBITS_APP | DBITS_DATA | DBITS_WRT)
+
 
 /* Segment selectors */
 #define SEL_KCODE    8
 #define SEL_KDATA    16
 #define SEL_UCODE    27
 #define SEL_UDATA    35
+#define SEL_KLOCAL   48
 
 
 #define NULL 0
@@ -368,7 +372,7 @@ static inline void hal_cpuGetCycles(void *cb)
 		movl %%edx, 4(%%edi)"
 		:
 		:"g" (cb)
-		:"eax", "edx", "edi");
+		:"eax", "edx", "edi", "memory");
 	return;
 }
 
@@ -667,6 +671,25 @@ static inline unsigned int hal_cpuGetID(void)
 }
 
 
+/* per-CPU data - kernel entry stubs load %gs with SEL_KLOCAL */
+
+
+static inline void *hal_cpuGetCurrent(void)
+{
+	void *current;
+
+	__asm__ volatile ("movl %%gs:0, %0" : "=r" (current));
+
+	return current;
+}
+
+
+static inline void hal_cpuSetCurrent(void *current)
+{
+	__asm__ volatile ("movl %0, %%gs:0" : : "r" (current) : "memory");
+}
+
+
 extern void _hal_cpuInitCores(void);
 
 
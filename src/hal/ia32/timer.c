@@ -20,8 +20,21 @@
 #include "../../../include/errno.h"
 
 
+/* PIT input clock frequency [Hz] */
+#define PIT_FREQ 1193182
+
+/* TSC calibration period [us] */
+#define TIMER_CALIBRATION 10000
+
+
 struct {
 	u32 interval;
+
+	/* TSC to microseconds conversion factor (32.32 fixed point) */
+	u64 tscmul;
+	volatile cycles_t tsctick;
+
+	intr_handler_t tickh;
 } timer;
 
 
@@ -32,13 +45,82 @@ int timer_reschedule(unsigned int n, cpu_context_t *ctx, void *arg)
 }
 
 
+static int timer_tickIrqHandler(unsigned int n, cpu_context_t *ctx, void *arg)
+{
+	cycles_t c;
+
+	/* Remember TSC value at the system tick for time interpolation */
+	hal_cpuGetCycles(&c);
+	timer.tsctick = c;
+
+	return EOK;
+}
+
+
+time_t hal_getTickOffset(void)
+{
+	cycles_t c;
+	u64 offs;
+
+	hal_cpuGetCycles(&c);
+	c -= timer.tsctick;
+
+	/* Tick has been delayed, avoid overflow of the multiplication below */
+	if (c > ((u64)1 << 32))
+		return timer.interval - 1;
+
+	offs = (c * timer.tscmul) >> 32;
+
+	/* Never go beyond next tick - keeps time monotonic */
+	if (offs >= timer.interval)
+		offs = timer.interval - 1;
+
+	return offs;
+}
+
+
+__attribute__ ((section (".init"))) static void _timer_calibrate(void)
+{
+	cycles_t b, e;
+	u32 t = (u32)(((u64)PIT_FREQ * TIMER_CALIBRATION) / 1000000);
+
+	/* Enable channel 2 gate, disable speaker output */
+	hal_outb((void *)0x61, (hal_inb((void *)0x61) & ~0x02) | 0x01);
+
+	/* Channel 2, operation - CE write, work mode 0, binary counting */
+	hal_outb((void *)0x43, 0xb0);
+	hal_outb((void *)0x42, (u8)(t & 0xff));
+	hal_outb((void *)0x42, (u8)(t >> 8));
+
+	/* Measure TSC cycles until channel 2 output goes high */
+	hal_cpuGetCycles(&b);
+	while (!(hal_inb((void *)0x61) & 0x20));
+	hal_cpuGetCycles(&e);
+
+	if (e > b)
+		timer.tscmul = ((u64)TIMER_CALIBRATION << 32) / (e - b);
+	else
+		timer.tscmul = 0;
+}
+
+
 __attribute__ ((section (".init"))) void _timer_init(u32 interval)
 {
 	unsigned int t;
 	
 	timer.interval = interval;
 
-	t = (u32)((interval * 1190) / 1000);	
+	_timer_calibrate();
+	hal_cpuGetCycles((void *)&timer.tsctick);
+
+	timer.tickh.data = NULL;
+	timer.tickh.n = SYSTICK_IRQ;
+	timer.tickh.f = timer_tickIrqHandler;
+
+	/* Installed before scheduler handlers so TSC is sampled first */
+	hal_interruptsSetHandler(&timer.tickh);
+
+	t = (u32)((interval * (PIT_FREQ / 1000)) / 1000);
 
 	/* First generator, operation - CE write, work mode 2, binary counting */
 	hal_outb((void *)0x43, 0x34);
@@ -24,6 +24,12 @@
 #define TIMER_US2CYC(x) (x)
 #define TIMER_CYC2US(x) (x)
 
+/* Time between system ticks is interpolated using TSC */
+#define TIMER_INTERPOLATION
+
+
+extern time_t hal_getTickOffset(void);
+
 
 extern int timer_reschedule(unsigned int n, cpu_context_t *ctx, void *arg);
 
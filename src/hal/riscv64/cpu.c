@@ -25,6 +25,10 @@
 extern int threads_schedule(unsigned int n, cpu_context_t *context, void *arg);
 
 
+/* tp is used as a scratch register on kernel entry, current thread is kept in memory */
+void *hal_cpuCurrent;
+
+
 int hal_platformctl(void *ptr)
 {
 	return EOK;
@@ -60,8 +60,13 @@ typedef struct _event_t {
 
 struct {
 	rbtree_t pid;
-	lock_t lock;
+	rwlock_t lock;
+	spinlock_t spinlock; /* Protects references taken with shared lock */
 	id_t fresh;
+
+	/* Pipe server is looked up once */
+	int pipesrvValid;
+	oid_t pipesrv;
 } posix_common;
 
 
@@ -70,8 +75,11 @@ process_info_t *_pinfo_find(unsigned int pid)
 	process_info_t pi, *r;
 	pi.process = pid;
 
-	if ((r = lib_treeof(process_info_t, linkage, lib_rbFind(&posix_common.pid, &pi.linkage))) != NULL)
+	if ((r = lib_treeof(process_info_t, linkage, lib_rbFind(&posix_common.pid, &pi.linkage))) != NULL) {
+		hal_spinlockSet(&posix_common.spinlock);
 		r->refs++;
+		hal_spinlockClear(&posix_common.spinlock);
+	}
 
 	return r;
 }
@@ -80,9 +88,9 @@ process_info_t *_pinfo_find(unsigned int pid)
 process_info_t *pinfo_find(unsigned int pid)
 {
 	process_info_t *r;
-	proc_lockSet(&posix_common.lock);
+	proc_rwLockRead(&posix_common.lock);
 	r = _pinfo_find(pid);
-	proc_lockClear(&posix_common.lock);
+	proc_rwLockClear(&posix_common.lock);
 	return r;
 }
 
@@ -90,9 +98,9 @@ process_info_t *pinfo_find(unsigned int pid)
 void posix_destroy(process_info_t *p)
 {
 	// lib_printf("removing %d\n", p->process);
-	proc_lockSet(&posix_common.lock);
+	proc_rwLockWrite(&posix_common.lock);
 	lib_rbRemove(&posix_common.pid, &p->linkage);
-	proc_lockClear(&posix_common.lock);
+	proc_rwLockClear(&posix_common.lock);
 
 	vm_kfree(p->fds);
 	proc_lockDone(&p->lock);
@@ -104,9 +112,9 @@ void pinfo_put(process_info_t *p)
 {
 	int remaining;
 
-	proc_lockSet(&posix_common.lock);
+	proc_rwLockWrite(&posix_common.lock);
 	remaining = --p->refs;
-	proc_lockClear(&posix_common.lock);
+	proc_rwLockClear(&posix_common.lock);
 
 	if (!remaining)
 		posix_destroy(p);
@@ -153,8 +161,7 @@ static int posix_fileDeref(open_file_t *f)
 {
 	int err = EOK;
 
-	proc_lockSet(&f->lock);
-	if (!--f->refs) {
+	if (!lib_atomicDecrement(&f->refs)) {
 		if (f->type != ftUnixSocket) {
 			while ((err = proc_close(f->oid, f->status)) == -EINTR) ;
 		}
@@ -162,9 +169,6 @@ static int posix_fileDeref(open_file_t *f)
 		proc_lockDone(&f->lock);
 		vm_kfree(f);
 	}
-	else {
-		proc_lockClear(&f->lock);
-	}
 	return err;
 }
 
@@ -184,22 +188,19 @@ static int posix_getOpenFile(int fd, open_file_t **f)
 {
 	process_info_t *p;
 
-	if ((p = pinfo_find(proc_current()->process->id)) == NULL)
+	/* Caller's process info outlives its threads, no lookup or reference needed */
+	if ((p = proc_current()->process->posix) == NULL)
 		return -ENOSYS;
 
 	proc_lockSet(&p->lock);
 	if (fd < 0 || fd > p->maxfd || (*f = p->fds[fd].file) == NULL) {
 		proc_lockClear(&p->lock);
-		pinfo_put(p);
 		return -EBADF;
 	}
 
-	proc_lockSet(&(*f)->lock);
-	(*f)->refs++;
-	proc_lockClear(&(*f)->lock);
+	lib_atomicIncrement(&(*f)->refs);
 	proc_lockClear(&p->lock);
 
-	pinfo_put(p);
 	return 0;
 }
 
@@ -315,11 +316,8 @@ int posix_clone(int ppid)
 		hal_memcpy(p->fds, pp->fds, (pp->maxfd + 1) * sizeof(fildes_t));
 
 		for (i = 0; i <= p->maxfd; ++i) {
-			if ((f = p->fds[i].file) != NULL) {
-				proc_lockSet(&f->lock);
-				++f->refs;
-				proc_lockClear(&f->lock);
-			}
+			if ((f = p->fds[i].file) != NULL)
+				lib_atomicIncrement(&f->refs);
 		}
 
 		proc_lockClear(&pp->lock);
@@ -352,9 +350,11 @@ int posix_clone(int ppid)
 		p->pgid = p->process;
 	}
 
-	proc_lockSet(&posix_common.lock);
+	proc_rwLockWrite(&posix_common.lock);
 	lib_rbInsert(&posix_common.pid, &p->linkage);
-	proc_lockClear(&posix_common.lock);
+	proc_rwLockClear(&posix_common.lock);
+
+	proc->posix = p;
 
 	return EOK;
 }
@@ -450,20 +450,39 @@ static int posix_create(const char *filename, int type, mode_t mode, oid_t dev,
 }
 
 
+static int posix_pipesrv(oid_t *pipesrv)
+{
+	int err = EOK, valid;
+
+	hal_spinlockSet(&posix_common.spinlock);
+	valid = posix_common.pipesrvValid;
+	*pipesrv = posix_common.pipesrv;
+	hal_spinlockClear(&posix_common.spinlock);
+
+	if (!valid && (err = proc_lookup("/dev/posix/pipes", NULL, pipesrv)) == EOK) {
+		hal_spinlockSet(&posix_common.spinlock);
+		posix_common.pipesrv = *pipesrv;
+		posix_common.pipesrvValid = 1;
+		hal_spinlockClear(&posix_common.spinlock);
+	}
+
+	return err;
+}
+
+
 /* TODO: handle O_CREAT and O_EXCL */
 int posix_open(const char *filename, int oflag, char *ustack)
 {
 	TRACE("open(%s, %d, %d)", filename, oflag);
 	oid_t ln, oid, dev, pipesrv;
-	int fd = 0, err = 0;
+	int fd = 0, err = 0, opened;
 	process_info_t *p;
 	open_file_t *f;
 	mode_t mode;
+	offs_t size;
 
-	hal_memset(&pipesrv, 0xff, sizeof(oid_t));
-
-	if ((proc_lookup("/dev/posix/pipes", NULL, &pipesrv)) < 0)
-		; /* that's fine */
+	if (posix_pipesrv(&pipesrv) < 0)
+		hal_memset(&pipesrv, 0xff, sizeof(oid_t)); /* that's fine */
 
 	if ((p = pinfo_find(proc_current()->process->id)) == NULL)
 		return -1;
@@ -484,7 +503,9 @@ int posix_open(const char *filename, int oflag, char *ustack)
 		proc_lockClear(&p->lock);
 
 		do {
-			if ((err = proc_lookup(filename, &ln, &oid)) == EOK) {
+			/* Lookup and open are done in one request if file server supports it */
+			ln.id = 0;
+			if ((err = proc_openPath(filename, oflag, &ln, &oid, &opened, &size)) >= 0) {
 				/* pass */
 			}
 			else if (err == -ENOENT && oflag & O_CREAT) {
@@ -495,12 +516,13 @@ int posix_open(const char *filename, int oflag, char *ustack)
 					break;
 				}
 				hal_memcpy(&ln, &oid, sizeof(oid_t));
+				err = EOK;
 			}
 			else {
 				break;
 			}
 
-			if (oid.port != US_PORT && (err = proc_open(oid, oflag)) < 0)
+			if (!opened && oid.port != US_PORT && (err = proc_open(oid, oflag)) < 0)
 				break;
 
 			proc_lockSet(&p->lock);
@@ -528,12 +550,15 @@ int posix_open(const char *filename, int oflag, char *ustack)
 			else
 				f->type = ftRegular;
 
-			if (oflag & O_APPEND)
-				f->offset = proc_size(f->oid);
-			else
+			if (!(oflag & O_APPEND))
 				f->offset = 0;
+			else if (opened)
+				f->offset = size;
+			else
+				f->offset = proc_size(f->oid);
 
-			if (oflag & O_TRUNC)
+			/* Server opening file by path truncates it as well */
+			if ((oflag & O_TRUNC) && !opened)
 				posix_truncate(&f->oid, 0);
 
 			f->status = oflag & ~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC | O_CLOEXEC);
@@ -703,9 +728,7 @@ int posix_dup(int fildes)
 
 		p->fds[newfd].file = f;
 		p->fds[newfd].flags = 0;
-		proc_lockSet(&f->lock);
-		f->refs++;
-		proc_lockClear(&f->lock);
+		lib_atomicIncrement(&f->refs);
 		proc_lockClear(&p->lock);
 		pinfo_put(p);
 
@@ -740,9 +763,7 @@ int _posix_dup2(process_info_t *p, int fildes, int fildes2)
 	p->fds[fildes2].file = f;
 	p->fds[fildes2].flags = 0;
 
-	proc_lockSet(&f->lock);
-	f->refs++;
-	proc_lockClear(&f->lock);
+	lib_atomicIncrement(&f->refs);
 
 	return fildes2;
 }
@@ -781,7 +802,7 @@ int posix_pipe(int fildes[2])
 
 	hal_memset(&oid, 0, sizeof(oid));
 
-	if ((res = proc_lookup("/dev/posix/pipes", NULL, &pipesrv)) < 0) {
+	if ((res = posix_pipesrv(&pipesrv)) < 0) {
 		pinfo_put(p);
 		return res == -EINTR ? res : -ENOSYS;
 	}
@@ -855,7 +876,7 @@ int posix_mkfifo(const char *pathname, mode_t mode)
 
 	hal_memset(&oid, 0, sizeof(oid));
 
-	if ((proc_lookup("/dev/posix/pipes", NULL, &pipesrv)) < 0)
+	if (posix_pipesrv(&pipesrv) < 0)
 		return -ENOSYS;
 
 	if (proc_create(pipesrv.port, pxBufferedPipe, 0, oid, pipesrv, NULL, &oid) < 0)
@@ -1049,6 +1070,44 @@ int posix_ftruncate(int fildes, off_t length)
 }
 
 
+/* Fetches all attributes in one request, on failure server is asked for each of them */
+static int posix_getAttrAll(oid_t *oid, struct stat *buf)
+{
+	msg_t msg;
+	msgattr_t attr;
+	int err;
+
+	hal_memset(&msg, 0, sizeof(msg_t));
+	hal_memset(&attr, 0, sizeof(attr));
+
+	msg.type = mtGetAttrAll;
+	hal_memcpy(&msg.i.attr.oid, oid, sizeof(oid_t));
+	msg.o.data = &attr;
+	msg.o.size = sizeof(attr);
+
+	if ((err = proc_send(oid->port, &msg)) < 0)
+		return err;
+
+	if ((err = msg.o.attr.val) < 0)
+		return err;
+
+	/* Server not supporting request may answer without filling attributes */
+	if (!attr.valid)
+		return -ENOSYS;
+
+	buf->st_mtime = attr.mtime;
+	buf->st_atime = attr.atime;
+	buf->st_ctime = attr.ctime;
+	buf->st_nlink = attr.links;
+	buf->st_mode = attr.mode;
+	buf->st_uid = attr.uid;
+	buf->st_gid = attr.gid;
+	buf->st_size = attr.size;
+
+	return EOK;
+}
+
+
 int posix_fstat(int fd, struct stat *buf)
 {
 	TRACE("fstat(%d)", fd);
@@ -1065,7 +1124,10 @@ int posix_fstat(int fd, struct stat *buf)
 		buf->st_ino = (int)f->ln.id; /* FIXME */
 		buf->st_rdev = f->oid.port;
 
-		if (f->type == ftRegular) {
+		if (f->type == ftRegular && (err = posix_getAttrAll(&f->oid, buf)) == EOK) {
+			/* pass */
+		}
+		else if (f->type == ftRegular) {
 			msg.type = mtGetAttr;
 			hal_memcpy(&msg.i.attr.oid, &f->oid, sizeof(oid_t));
 			msg.i.attr.val = 0;
@@ -2059,14 +2121,14 @@ static int posix_killGroup(pid_t pgid, int sig)
 	process_info_t *pinfo;
 	rbnode_t *node;
 
-	proc_lockSet(&posix_common.lock);
+	proc_rwLockRead(&posix_common.lock);
 	for (node = lib_rbMinimum(posix_common.pid.root); node != NULL; node = lib_rbNext(node)) {
 		pinfo = lib_treeof(process_info_t, linkage, node);
 
 		if (pinfo->pgid == pgid)
 			proc_sigpost(pinfo->process, sig);
 	}
-	proc_lockClear(&posix_common.lock);
+	proc_rwLockClear(&posix_common.lock);
 
 	return EOK;
 }
@@ -2282,8 +2344,10 @@ pid_t posix_getppid(pid_t pid)
 
 void posix_init(void)
 {
-	proc_lockInit(&posix_common.lock);
+	proc_rwLockInit(&posix_common.lock);
+	hal_spinlockCreate(&posix_common.spinlock, "posix_common.spinlock");
 	lib_rbInit(&posix_common.pid, pinfo_cmp, NULL);
 	unix_sockets_init();
 	posix_common.fresh = 0;
+	posix_common.pipesrvValid = 0;
 }
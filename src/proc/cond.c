@@ -110,7 +110,7 @@ int proc_condBroadcast(unsigned int c)
 	if ((cond = cond_get(c)) == NULL)
 		return -EINVAL;
 
-	proc_threadBroadcastYield(&cond->queue);
+	proc_lockBroadcast(&cond->queue);
 
 	if (!cond_put(cond))
 		err = -EINVAL;
@@ -0,0 +1,146 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Fast userspace mutexes (wait/wake on user address)
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include HAL
+#include "../../include/errno.h"
+#include "../lib/lib.h"
+#include "futex.h"
+#include "threads.h"
+
+#define HASH_LEN 6 /* Number of wait queues = 2 ^ HASH_LEN */
+
+
+typedef struct _futex_waiter_t {
+	struct _futex_waiter_t *next;
+	struct _futex_waiter_t *prev;
+
+	/* Key - waiting process and user address */
+	process_t *process;
+	u32 *addr;
+
+	thread_t *queue;
+} futex_waiter_t;
+
+
+typedef struct {
+	lock_t lock;
+	futex_waiter_t *waiters;
+} futex_bucket_t;
+
+
+struct {
+	futex_bucket_t buckets[1 << HASH_LEN];
+} futex_common;
+
+
+static futex_bucket_t *futex_bucket(process_t *process, u32 *addr)
+{
+	unsigned int hash = ((addr_t)addr >> 2) ^ ((addr_t)process >> 4);
+
+	hash ^= hash >> HASH_LEN;
+	hash ^= hash >> (2 * HASH_LEN);
+
+	return &futex_common.buckets[hash & ((1 << HASH_LEN) - 1)];
+}
+
+
+int proc_futexWait(u32 *addr, u32 val, time_t timeout)
+{
+	futex_waiter_t w;
+	futex_bucket_t *b;
+	int err;
+
+	if (addr == NULL || ((addr_t)addr & (sizeof(u32) - 1)))
+		return -EINVAL;
+
+	w.process = proc_current()->process;
+	w.addr = addr;
+	w.queue = NULL;
+
+#ifndef NOMMU
+	/* Word is read in kernel mode, it has to belong to caller's address space */
+	if (w.process != NULL && (w.process->mapp == NULL || !pmap_belongs(&w.process->mapp->pmap, addr)))
+		return -EINVAL;
+#endif
+
+	b = futex_bucket(w.process, addr);
+
+	/* Value is read with sleeping lock held, page fault on user address can be handled */
+	proc_lockSet(&b->lock);
+
+	if (*(volatile u32 *)addr != val) {
+		proc_lockClear(&b->lock);
+		return -EAGAIN;
+	}
+
+	LIST_ADD(&b->waiters, &w);
+
+	if ((err = proc_lockWait(&w.queue, &b->lock, timeout)) == -EINTR)
+		proc_lockSet(&b->lock);
+
+	/* Woken up by timeout or signal */
+	if (w.addr != NULL) {
+		LIST_REMOVE(&b->waiters, &w);
+	}
+	else {
+		err = EOK;
+	}
+
+	proc_lockClear(&b->lock);
+
+	return err;
+}
+
+
+int proc_futexWake(u32 *addr, unsigned int n)
+{
+	futex_waiter_t *w, *next, *last;
+	futex_bucket_t *b;
+	process_t *process;
+	unsigned int woken = 0;
+
+	if (addr == NULL || ((addr_t)addr & (sizeof(u32) - 1)))
+		return -EINVAL;
+
+	process = proc_current()->process;
+	b = futex_bucket(process, addr);
+
+	proc_lockSet(&b->lock);
+
+	for (w = b->waiters, last = (w != NULL) ? w->prev : NULL; w != NULL && woken < n; w = next) {
+		next = (w == last) ? NULL : w->next;
+
+		if (w->process == process && w->addr == addr) {
+			LIST_REMOVE(&b->waiters, w);
+			w->addr = NULL;
+			proc_threadWakeup(&w->queue);
+			woken++;
+		}
+	}
+
+	proc_lockClear(&b->lock);
+
+	return woken;
+}
+
+
+void _futex_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(futex_common.buckets) / sizeof(futex_common.buckets[0]); i++) {
+		futex_common.buckets[i].waiters = NULL;
+		proc_lockInit(&futex_common.buckets[i].lock);
+	}
+}
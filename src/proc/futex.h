@@ -0,0 +1,30 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Fast userspace mutexes (wait/wake on user address)
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _PROC_FUTEX_H_
+#define _PROC_FUTEX_H_
+
+#include HAL
+
+
+extern int proc_futexWait(u32 *addr, u32 val, time_t timeout);
+
+
+extern int proc_futexWake(u32 *addr, unsigned int n);
+
+
+extern void _futex_init(void);
+
+
+#endif
@@ -24,9 +24,13 @@ typedef struct _lock_t {
 	volatile char v;
 	volatile struct _thread_t *owner;
 
-	/* Saved original priority of mutex holder to be restored once mutex is released */
+	/* Highest priority of waiting threads, inherited by mutex holder (synchronized by scheduler) */
 	unsigned int priority;
 	struct _thread_t *queue;
+
+	/* Linkage in list of locks held by owner */
+	struct _lock_t *next;
+	struct _lock_t *prev;
 } lock_t;
 
 
@@ -42,6 +46,10 @@ extern int proc_lockTry(lock_t *lock);
 extern int proc_lockWait(struct _thread_t **queue, lock_t *lock, time_t timeout);
 
 
+/* Wakes up one of proc_lockWait waiters and requeues the rest on the lock they reacquire */
+extern void proc_lockBroadcast(struct _thread_t **queue);
+
+
 extern int proc_lockClear(lock_t *lock);
 
 
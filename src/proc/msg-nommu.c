@@ -18,21 +18,222 @@
 #include "proc.h"
 
 
-enum { msg_rejected = -1, msg_waiting = 0, msg_received, msg_responded };
+enum { msg_rejected = -1, msg_waiting = 0, msg_received, msg_responded, msg_notify };
+
+
+#define MSG_PULSES     16 /* Preallocated pulse notifications, pool grows if they run out */
+#define MSG_PORTPULSES 8  /* Maximal number of distinct pulses pending on port */
+
+
+typedef struct {
+	kmsg_t kmsg;
+	msg_t msg;
+} pulse_t;
 
 
 struct {
 	vm_map_t *kmap;
 	vm_object_t *kernel;
+
+	/* Pulse pool */
+	spinlock_t spinlock;
+	pulse_t pulses[MSG_PULSES];
+	kmsg_t *free;
 } msg_common;
 
 
-int proc_send(u32 port, msg_t *msg)
+/* Keeps port messages ordered by sender priority, FIFO within the same priority */
+static void _msg_enqueue(port_t *p, kmsg_t *kmsg)
+{
+	kmsg_t *t;
+
+	kmsg->port = p;
+	_port_signal(p);
+
+	if (++p->stats.depth > p->stats.maxdepth)
+		p->stats.maxdepth = p->stats.depth;
+
+	if ((t = p->kmessages) == NULL || t->msg->priority > kmsg->msg->priority) {
+		LIST_ADD(&p->kmessages, kmsg);
+		p->kmessages = kmsg;
+		return;
+	}
+
+	while ((t = t->next) != p->kmessages && t->msg->priority <= kmsg->msg->priority)
+		;
+
+	LIST_ADD(&t, kmsg);
+}
+
+
+static void _msg_dequeue(port_t *p, kmsg_t *kmsg)
+{
+	LIST_REMOVE(&p->kmessages, kmsg);
+	p->stats.depth--;
+}
+
+
+/* Accounts response to received message, port spinlock is held */
+static void _msg_statRespond(port_t *p, kmsg_t *kmsg)
+{
+	msg_t *msg = kmsg->msg;
+
+	if (msg->i.data >= (void *)msg->i.raw && msg->i.data < (void *)msg->i.raw + sizeof(msg->i.raw))
+		p->stats.packed += msg->i.size;
+	else
+		p->stats.mapped += msg->i.size;
+
+	if (msg->o.data >= (void *)msg->o.raw && msg->o.data < (void *)msg->o.raw + sizeof(msg->o.raw))
+		p->stats.packed += msg->o.size;
+	else
+		p->stats.mapped += msg->o.size;
+
+	_port_statRespond(p, kmsg->stamp);
+}
+
+
+int _proc_msgNotify(port_t *p, kmsg_t *kmsg)
+{
+	if (p->closed)
+		return -EINVAL;
+
+	if (kmsg->state != msg_notify) {
+		kmsg->msg->priority = proc_current()->priority;
+		kmsg->state = msg_notify;
+		_msg_enqueue(p, kmsg);
+		proc_threadWakeup(&p->threads);
+	}
+
+	return EOK;
+}
+
+
+static void _msg_notifyDone(kmsg_t *kmsg)
+{
+	kmsg->state = msg_received;
+
+	/* Return pulse to the pool */
+	if (kmsg->msg->type == mtPulse) {
+		hal_spinlockSet(&msg_common.spinlock);
+		LIST_ADD(&msg_common.free, kmsg);
+		hal_spinlockClear(&msg_common.spinlock);
+	}
+}
+
+
+void _proc_msgCancel(port_t *p, kmsg_t *kmsg)
+{
+	if (kmsg->state == msg_notify) {
+		_msg_dequeue(p, kmsg);
+
+		if (kmsg->msg->type == mtPulse)
+			p->pulses--;
+
+		_msg_notifyDone(kmsg);
+	}
+}
+
+
+void _proc_msgDrain(port_t *p)
+{
+	kmsg_t *kmsg;
+
+	while ((kmsg = p->kmessages) != NULL && kmsg->state == msg_notify)
+		_proc_msgCancel(p, kmsg);
+}
+
+
+static int msg_pulseMatch(kmsg_t *kmsg, int code, int value)
+{
+	return kmsg->state == msg_notify && kmsg->msg->type == mtPulse && kmsg->msg->i.pulse.code == code && kmsg->msg->i.pulse.value == value;
+}
+
+
+/* Takes pulse from the pool, allocates new one if the pool is empty */
+static kmsg_t *msg_pulseAlloc(void)
+{
+	kmsg_t *kmsg;
+	pulse_t *pulse;
+
+	hal_spinlockSet(&msg_common.spinlock);
+	if ((kmsg = msg_common.free) != NULL)
+		LIST_REMOVE(&msg_common.free, kmsg);
+	hal_spinlockClear(&msg_common.spinlock);
+
+	if (kmsg == NULL && (pulse = vm_kmalloc(sizeof(pulse_t))) != NULL) {
+		hal_memset(pulse, 0, sizeof(pulse_t));
+		kmsg = &pulse->kmsg;
+		kmsg->msg = &pulse->msg;
+		kmsg->msg->type = mtPulse;
+		kmsg->state = msg_received;
+	}
+
+	return kmsg;
+}
+
+
+int proc_pulse(u32 port, int code, int value)
+{
+	port_t *p;
+	kmsg_t *kmsg, *t;
+	int err = EOK;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	/* Pulse is taken in advance, the pool may have to grow */
+	if ((kmsg = msg_pulseAlloc()) == NULL) {
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+
+	hal_spinlockSet(&p->spinlock);
+
+	/* Coalesce with identical pending pulse */
+	if ((t = p->kmessages) != NULL) {
+		while (!msg_pulseMatch(t, code, value) && (t = t->next) != p->kmessages)
+			;
+	}
+
+	if (t == NULL || !msg_pulseMatch(t, code, value)) {
+		/* Port nobody drains can't use up pulses of others */
+		if (p->pulses >= MSG_PORTPULSES) {
+			err = -ENOSPC;
+		}
+		else {
+			kmsg->msg->pid = (proc_current()->process != NULL) ? proc_current()->process->id : 0;
+			kmsg->msg->i.pulse.code = code;
+			kmsg->msg->i.pulse.value = value;
+
+			if ((err = _proc_msgNotify(p, kmsg)) == EOK) {
+				p->pulses++;
+				kmsg = NULL;
+			}
+		}
+	}
+
+	/* Unused pulse goes back to the pool */
+	if (kmsg != NULL)
+		_msg_notifyDone(kmsg);
+
+	hal_spinlockClear(&p->spinlock);
+	port_put(p, 0);
+
+	return err;
+}
+
+
+static int msg_send(u32 port, msg_t *msg, time_t timeout)
 {
 	port_t *p;
 	int err = EOK;
 	kmsg_t kmsg;
 	thread_t *sender;
+	time_t deadline = 0;
+
+	/* Notifications are generated by kernel only */
+	if (msg->type == mtRing || msg->type == mtPulse)
+		return -EINVAL;
 
 	if ((p = proc_portGet(port)) == NULL)
 		return -EINVAL;
@@ -43,6 +244,11 @@ int proc_send(u32 port, msg_t *msg)
 	kmsg.src = sender->process;
 	kmsg.threads = NULL;
 	kmsg.state = msg_waiting;
+	kmsg.timed = (timeout != 0);
+	kmsg.stamp = proc_uptime();
+
+	if (timeout)
+		deadline = kmsg.stamp + timeout;
 
 	kmsg.msg->pid = (sender->process != NULL) ? sender->process->id : 0;
 	kmsg.msg->priority = sender->priority;
@@ -53,12 +259,26 @@ int proc_send(u32 port, msg_t *msg)
 		err = -EINVAL;
 	}
 	else {
-		LIST_ADD(&p->kmessages, &kmsg);
+		_msg_enqueue(p, &kmsg);
 
 		proc_threadWakeup(&p->threads);
 
-		while (kmsg.state != msg_responded && kmsg.state != msg_rejected)
-			err = proc_threadWait(&kmsg.threads, &p->spinlock, 0);
+		while (kmsg.state != msg_responded && kmsg.state != msg_rejected) {
+			/* Without MMU receiver uses sender buffers, so message being served is waited for */
+			if (kmsg.state != msg_waiting) {
+				err = proc_threadWait(&kmsg.threads, &p->spinlock, 0);
+			}
+			else if (err == -ETIME) {
+				_msg_dequeue(p, &kmsg);
+				break;
+			}
+			else {
+				err = proc_threadWaitUntil(&kmsg.threads, &p->spinlock, deadline);
+			}
+		}
+
+		if (kmsg.state == msg_responded)
+			err = EOK;
 	}
 
 	hal_spinlockClear(&p->spinlock);
@@ -69,72 +289,243 @@ int proc_send(u32 port, msg_t *msg)
 }
 
 
-int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
+int proc_send(u32 port, msg_t *msg)
 {
-	port_t *p;
-	kmsg_t *kmsg;
+	return msg_send(port, msg, 0);
+}
 
-	if ((p = proc_portGet(port)) == NULL)
-		return -EINVAL;
+
+int proc_sendTimed(u32 port, msg_t *msg, time_t timeout)
+{
+	return msg_send(port, msg, timeout);
+}
+
+
+static int msg_recv(port_t *p, msg_t *msg, unsigned int *rid, int wait, time_t deadline)
+{
+	kmsg_t *kmsg;
+	int err;
 
 	hal_spinlockSet(&p->spinlock);
 
-	while (p->kmessages == NULL && !p->closed)
-		proc_threadWait(&p->threads, &p->spinlock, 0);
+	while (p->kmessages == NULL && !p->closed) {
+		if (!wait) {
+			hal_spinlockClear(&p->spinlock);
+			return -EAGAIN;
+		}
+
+		if (!deadline) {
+			proc_threadWait(&p->threads, &p->spinlock, 0);
+		}
+		else if ((err = proc_threadWaitUntil(&p->threads, &p->spinlock, deadline)) == -ETIME) {
+			hal_spinlockClear(&p->spinlock);
+			return err;
+		}
+	}
 
 	kmsg = p->kmessages;
 
 	if (p->closed) {
 		/* Port is being removed */
-		if (kmsg != NULL) {
+		if (kmsg != NULL && kmsg->state == msg_notify) {
+			_proc_msgCancel(p, kmsg);
+		}
+		else if (kmsg != NULL) {
 			kmsg->state = msg_rejected;
-			LIST_REMOVE(&p->kmessages, kmsg);
+			_msg_dequeue(p, kmsg);
 			proc_threadWakeup(&kmsg->threads);
 		}
 
 		hal_spinlockClear(&p->spinlock);
-		port_put(p, 0);
 		return -EINVAL;
 	}
 
+	/* Notification needs no response and may be queued again once it is removed */
+	if (kmsg->state == msg_notify) {
+		hal_memcpy(msg, kmsg->msg, sizeof(*msg));
+		_proc_msgCancel(p, kmsg);
+		_port_statRecv(p, 0);
+		hal_spinlockClear(&p->spinlock);
+
+		*rid = 0;
+		return EOK;
+	}
+
 	kmsg->state = msg_received;
-	LIST_REMOVE(&p->kmessages, kmsg);
+	_msg_dequeue(p, kmsg);
+	kmsg->stamp = _port_statRecv(p, kmsg->stamp);
 	hal_spinlockClear(&p->spinlock);
 
 	/* (MOD) */
 	(*rid) = (unsigned long)(kmsg);
 
+	/* Serve message with priority of its sender */
+	proc_threadBoost(kmsg->msg->priority);
+
 	hal_memcpy(msg, kmsg->msg, sizeof(*msg));
 
-	port_put(p, 0);
 	return EOK;
 }
 
 
+/* Receives next message from set or any of its members */
+static int msg_setRecv(port_t *set, msg_t *msg, unsigned int *rid, time_t deadline)
+{
+	port_t *m;
+	unsigned int gen;
+	int err;
+
+	do {
+		gen = port_setGen(set);
+
+		if ((m = port_setSelect(set)) != NULL) {
+			err = msg_recv(m, msg, rid, 0, 0);
+			port_put(m, 0);
+
+			/* Member being removed is skipped */
+			if (err != -EAGAIN && (err != -EINVAL || m == set))
+				return err;
+		}
+	} while ((err = port_setWait(set, gen, deadline)) == EOK);
+
+	return err;
+}
+
+
+int proc_recvTimed(u32 port, msg_t *msg, unsigned int *rid, time_t timeout)
+{
+	port_t *p;
+	time_t deadline = 0;
+	int err;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	if (timeout)
+		deadline = proc_uptime() + timeout;
+
+	if (p->members != NULL)
+		err = msg_setRecv(p, msg, rid, deadline);
+	else
+		err = msg_recv(p, msg, rid, 1, deadline);
+
+	port_put(p, 0);
+	return err;
+}
+
+
+int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
+{
+	return proc_recvTimed(port, msg, rid, 0);
+}
+
+
 int proc_respond(u32 port, msg_t *msg, unsigned int rid)
 {
 	port_t *p;
 	size_t s = 0;
 	kmsg_t *kmsg = (kmsg_t *)(unsigned long)rid;
 
+	/* Notifications need no response */
+	if (kmsg == NULL)
+		return -EINVAL;
+
 	if ((p = proc_portGet(port)) == NULL)
 		return -EINVAL;
 
 	hal_memcpy(kmsg->msg->o.raw, msg->o.raw, sizeof(msg->o.raw));
+	proc_dcacheUpdate(kmsg->port->id, kmsg->msg->type);
+	proc_threadBoost(-1);
 
-	hal_spinlockSet(&p->spinlock);
+	/* Message may have been received through port set */
+	hal_spinlockSet(&kmsg->port->spinlock);
+	_msg_statRespond(kmsg->port, kmsg);
 	kmsg->state = msg_responded;
 	kmsg->src = proc_current()->process;
 	proc_threadWakeup(&kmsg->threads);
-	hal_spinlockClear(&p->spinlock);
+	hal_spinlockClear(&kmsg->port->spinlock);
 	port_put(p, 0);
 
 	return s;
 }
 
 
+static void *msg_gather(const msgiov_t *iov, unsigned int iovcnt, size_t *size, int copy)
+{
+	unsigned int i;
+	size_t offs;
+	void *data;
+
+	for (i = 0, *size = 0; i < iovcnt; i++)
+		*size += iov[i].size;
+
+	/* Without MMU single segment is passed by pointer */
+	if (iovcnt == 1 || *size == 0)
+		return iovcnt ? iov[0].data : NULL;
+
+	if ((data = vm_kmalloc(*size)) != NULL && copy) {
+		for (i = 0, offs = 0; i < iovcnt; offs += iov[i++].size)
+			hal_memcpy(data + offs, iov[i].data, iov[i].size);
+	}
+
+	return data;
+}
+
+
+int proc_sendv(u32 port, msg_t *msg, const msgiov_t *iiov, unsigned int iiovcnt, const msgiov_t *oiov, unsigned int oiovcnt)
+{
+	unsigned int i;
+	size_t offs;
+	int err;
+
+	msg->i.data = msg_gather(iiov, iiovcnt, &msg->i.size, 1);
+	msg->o.data = msg_gather(oiov, oiovcnt, &msg->o.size, 0);
+
+	if ((msg->i.size && msg->i.data == NULL) || (msg->o.size && msg->o.data == NULL))
+		err = -ENOMEM;
+	else
+		err = proc_send(port, msg);
+
+	if (oiovcnt > 1 && msg->o.data != NULL) {
+		for (i = 0, offs = 0; err == EOK && i < oiovcnt; offs += oiov[i++].size)
+			hal_memcpy(oiov[i].data, msg->o.data + offs, oiov[i].size);
+
+		vm_kfree(msg->o.data);
+	}
+
+	if (iiovcnt > 1 && msg->i.data != NULL)
+		vm_kfree(msg->i.data);
+
+	return err;
+}
+
+
+int proc_respondAndRecv(u32 port, msg_t *msg, unsigned int *rid)
+{
+	int err;
+
+	if (*rid != 0 && (err = proc_respond(port, msg, *rid)) < 0)
+		return err;
+
+	return proc_recv(port, msg, rid);
+}
+
+
 void _msg_init(vm_map_t *kmap, vm_object_t *kernel)
 {
+	unsigned int i;
+
 	msg_common.kmap = kmap;
 	msg_common.kernel = kernel;
+
+	hal_spinlockCreate(&msg_common.spinlock, "msg_common.spinlock");
+	msg_common.free = NULL;
+
+	for (i = 0; i < MSG_PULSES; i++) {
+		hal_memset(&msg_common.pulses[i], 0, sizeof(pulse_t));
+		msg_common.pulses[i].kmsg.msg = &msg_common.pulses[i].msg;
+		msg_common.pulses[i].msg.type = mtPulse;
+		msg_common.pulses[i].kmsg.state = msg_received;
+		LIST_ADD(&msg_common.free, &msg_common.pulses[i].kmsg);
+	}
 }
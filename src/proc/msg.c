@@ -21,16 +21,459 @@
 #define FLOOR(x)    ((x) & ~(SIZE_PAGE - 1))
 #define CEIL(x)     (((x) + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1))
 
+#define MSG_SLOTS   32                 /* Receive window slots per address space */
+#define MSG_SLOTSZ  (16 * SIZE_PAGE)   /* Bigger buffers get their own map entry */
+#define MSG_PULSES  64                 /* Preallocated pulse notifications, pool grows if they run out */
+#define MSG_PORTPULSES 8               /* Maximal number of distinct pulses pending on port */
 
-enum { msg_rejected = -1, msg_waiting = 0, msg_received, msg_responded };
+#ifndef MSG_INLINESZ
+#define MSG_INLINESZ 2048              /* Smaller payloads are copied instead of mapped */
+#endif
+
+#define MSG_IOVSZ   SIZE_PAGE          /* Vectored payloads up to this size are gathered in kernel buffer */
+#define MSG_IOVMAX  64                 /* Maximal number of segments of vectored payload */
+
+
+enum { msg_rejected = -1, msg_waiting = 0, msg_received, msg_responded, msg_notify, msg_abandoned };
+
+
+typedef struct {
+	spinlock_t spinlock;
+	void *vaddr;
+} msg_window_t;
 
 
 struct {
 	vm_map_t *kmap;
 	vm_object_t *kernel;
+
+	/* Per-CPU windows for copying boundary pages */
+	msg_window_t *windows;
+
+	/* Pulse pool */
+	spinlock_t spinlock;
+	kmsg_t pulses[MSG_PULSES];
+	kmsg_t *free;
 } msg_common;
 
 
+/* Copies from (or to) physical page through per-CPU window */
+static void msg_pageCopy(addr_t pa, int attr, unsigned int offs, void *buff, size_t len, int topage)
+{
+	msg_window_t *window = &msg_common.windows[hal_cpuGetID()];
+
+	hal_spinlockSet(&window->spinlock);
+	pmap_enter(&msg_common.kmap->pmap, pa, window->vaddr, attr, NULL);
+
+	if (topage)
+		hal_memcpy(window->vaddr + offs, buff, len);
+	else
+		hal_memcpy(buff, window->vaddr + offs, len);
+
+	pmap_remove(&msg_common.kmap->pmap, window->vaddr);
+	hal_spinlockClear(&window->spinlock);
+}
+
+
+/* Allocates receive window slot, inline slots are persistent anonymous memory */
+static void *msg_slotAlloc(vm_map_t *map, int inl)
+{
+	void **area = inl ? &map->msgbuf : &map->msgwin;
+	u32 *slots = inl ? &map->msgbufslots : &map->msgslots;
+	size_t slotsz = inl ? MSG_INLINESZ : MSG_SLOTSZ;
+	void *win;
+	unsigned int i;
+	u32 s;
+
+	/* Reserve window on first receive */
+	if (__atomic_load_n(area, __ATOMIC_ACQUIRE) == NULL) {
+		if (inl)
+			win = vm_mmap(map, NULL, NULL, CEIL(MSG_SLOTS * slotsz), PROT_READ | PROT_WRITE | PROT_USER, NULL, -1, MAP_NOINHERIT);
+		else
+			win = vm_mapFind(map, NULL, MSG_SLOTS * slotsz, MAP_NOINHERIT, PROT_READ | PROT_WRITE | PROT_USER);
+
+		if (win == NULL)
+			return NULL;
+
+		proc_rwLockWrite(&map->lock);
+		if (*area == NULL) {
+			__atomic_store_n(area, win, __ATOMIC_RELEASE);
+			win = NULL;
+		}
+		proc_rwLockClear(&map->lock);
+
+		if (win != NULL)
+			vm_munmap(map, win, CEIL(MSG_SLOTS * slotsz));
+	}
+
+	/* Slots are taken and released atomically, map lock isn't needed */
+	s = __atomic_load_n(slots, __ATOMIC_RELAXED);
+
+	do {
+		if (s == (u32)-1)
+			return NULL;
+
+		i = hal_cpuGetFirstBit(~s);
+	} while (!__atomic_compare_exchange_n(slots, &s, s | (1 << i), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return *area + i * slotsz;
+}
+
+
+int proc_msgWindow(vm_map_t *map, void *vaddr, size_t size)
+{
+	void *win = map->msgwin, *buf = map->msgbuf;
+
+	if (win != NULL && vaddr < win + MSG_SLOTS * MSG_SLOTSZ && vaddr + size > win)
+		return 1;
+
+	if (buf != NULL && vaddr < buf + CEIL(MSG_SLOTS * MSG_INLINESZ) && vaddr + size > buf)
+		return 1;
+
+	return 0;
+}
+
+
+static int msg_inlineSlot(vm_map_t *map, void *w)
+{
+	return map->msgbuf != NULL && w >= map->msgbuf && w < map->msgbuf + MSG_SLOTS * MSG_INLINESZ;
+}
+
+
+static void msg_unmap(vm_map_t *map, void *w, size_t size)
+{
+	void *v;
+
+	if (msg_inlineSlot(map, w)) {
+		/* Inline slot stays mapped */
+		__atomic_and_fetch(&map->msgbufslots, ~(1 << ((w - map->msgbuf) / MSG_INLINESZ)), __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (map->msgwin == NULL || w < map->msgwin || w >= map->msgwin + MSG_SLOTS * MSG_SLOTSZ) {
+		vm_munmap(map, w, size);
+		return;
+	}
+
+	for (v = w; v < w + size; v += SIZE_PAGE)
+		pmap_remove(&map->pmap, v);
+
+	__atomic_and_fetch(&map->msgslots, ~(1 << ((w - map->msgwin) / MSG_SLOTSZ)), __ATOMIC_RELEASE);
+}
+
+
+/* Bounces payload through kernel buffer if it is small and not packed, payload of timed send is bounced whole */
+static void msg_kbuf(int dir, kmsg_t *kmsg)
+{
+	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
+	void *data = dir ? kmsg->msg.o.data : kmsg->msg.i.data;
+	size_t size = dir ? kmsg->msg.o.size : kmsg->msg.i.size;
+
+	ml->kbuf = NULL;
+
+	if (data == NULL || size == 0)
+		return;
+
+	if (!kmsg->timed && (size > MSG_INLINESZ || kmsg->src == NULL))
+		return;
+
+	if (data >= (void *)kmsg->msg.i.raw && data < (void *)kmsg->msg.i.raw + sizeof(kmsg->msg.i.raw))
+		return;
+
+	/* Output is copied too, bytes not written by receiver are returned unchanged */
+	if ((ml->kbuf = vm_kmalloc(size)) != NULL)
+		hal_memcpy(ml->kbuf, data, size);
+}
+
+
+/* Returns 1 if payload doesn't reference sender's memory */
+static int msg_bounced(int dir, kmsg_t *kmsg)
+{
+	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
+	void *data = dir ? kmsg->msg.o.data : kmsg->msg.i.data;
+	size_t size = dir ? kmsg->msg.o.size : kmsg->msg.i.size;
+
+	if (data == NULL || size == 0 || ml->kbuf != NULL)
+		return 1;
+
+	return !dir && data >= (void *)kmsg->msg.i.raw && data < (void *)kmsg->msg.i.raw + sizeof(kmsg->msg.i.raw);
+}
+
+
+/* Gathers small vectored payload into kernel buffer, bigger one is mapped segment by segment */
+static int msg_gather(int dir, kmsg_t *kmsg, const msgiov_t *iov, unsigned int iovcnt)
+{
+	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
+	size_t size = 0, offs = 0;
+	unsigned int i, n = 0;
+	void *data = NULL;
+
+	if (iovcnt > MSG_IOVMAX)
+		return -EINVAL;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].size > (size_t)-1 - size)
+			return -EINVAL;
+
+		if (iov[i].size != 0) {
+			data = iov[i].data;
+			n++;
+		}
+
+		size += iov[i].size;
+	}
+
+	if (size <= MSG_IOVSZ)
+		data = NULL;
+
+	/* Segments are kept for receiver, data only marks payload as present */
+	if (size > MSG_IOVSZ && n > 1) {
+		if ((ml->iov = vm_kmalloc(n * sizeof(msgiov_t))) == NULL)
+			return -ENOMEM;
+
+		for (i = 0, n = 0; i < iovcnt; i++) {
+			if (iov[i].size != 0)
+				ml->iov[n++] = iov[i];
+		}
+
+		ml->iovcnt = n;
+		data = ml->iov[0].data;
+	}
+
+	if (dir) {
+		kmsg->msg.o.data = data;
+		kmsg->msg.o.size = size;
+	}
+	else {
+		kmsg->msg.i.data = data;
+		kmsg->msg.i.size = size;
+	}
+
+	if (size == 0 || data != NULL)
+		return EOK;
+
+	if ((ml->kbuf = vm_kmalloc(size)) == NULL)
+		return -ENOMEM;
+
+	/* Output segments are gathered as well, whole buffer is scattered back */
+	for (i = 0; i < iovcnt; offs += iov[i++].size)
+		hal_memcpy(ml->kbuf + offs, iov[i].data, iov[i].size);
+
+	if (dir)
+		kmsg->msg.o.data = ml->kbuf;
+	else
+		kmsg->msg.i.data = ml->kbuf;
+
+	return EOK;
+}
+
+
+static void msg_scatter(const void *data, size_t size, const msgiov_t *iov, unsigned int iovcnt)
+{
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < iovcnt && size; i++, data += len, size -= len) {
+		len = min(iov[i].size, size);
+		hal_memcpy(iov[i].data, data, len);
+	}
+}
+
+
+/* Keeps port messages ordered by sender priority, FIFO within the same priority */
+static void _msg_enqueue(port_t *p, kmsg_t *kmsg)
+{
+	kmsg_t *t;
+
+	kmsg->port = p;
+	_port_signal(p);
+
+	if (++p->stats.depth > p->stats.maxdepth)
+		p->stats.maxdepth = p->stats.depth;
+
+	if ((t = p->kmessages) == NULL || t->msg.priority > kmsg->msg.priority) {
+		LIST_ADD(&p->kmessages, kmsg);
+		p->kmessages = kmsg;
+		return;
+	}
+
+	while ((t = t->next) != p->kmessages && t->msg.priority <= kmsg->msg.priority)
+		;
+
+	LIST_ADD(&t, kmsg);
+}
+
+
+static void _msg_dequeue(port_t *p, kmsg_t *kmsg)
+{
+	LIST_REMOVE(&p->kmessages, kmsg);
+	p->stats.depth--;
+}
+
+
+/* Accounts response to received message, port spinlock is held */
+static void _msg_statRespond(port_t *p, kmsg_t *kmsg)
+{
+	msg_t *msg = &kmsg->msg;
+
+	if (msg->i.data >= (void *)msg->i.raw && msg->i.data < (void *)msg->i.raw + sizeof(msg->i.raw))
+		p->stats.packed += msg->i.size;
+	else
+		p->stats.mapped += msg->i.size;
+
+	if (msg->o.data >= (void *)msg->o.raw && msg->o.data < (void *)msg->o.raw + sizeof(msg->o.raw))
+		p->stats.packed += msg->o.size;
+	else
+		p->stats.mapped += msg->o.size;
+
+	_port_statRespond(p, kmsg->stamp);
+}
+
+
+int _proc_msgNotify(port_t *p, kmsg_t *kmsg)
+{
+	if (p->closed)
+		return -EINVAL;
+
+	if (kmsg->state != msg_notify) {
+		kmsg->msg.priority = proc_current()->priority;
+		kmsg->state = msg_notify;
+		_msg_enqueue(p, kmsg);
+		proc_threadWakeup(&p->threads);
+	}
+
+	return EOK;
+}
+
+
+static void _msg_notifyDone(kmsg_t *kmsg)
+{
+	kmsg->state = msg_received;
+
+	/* Return pulse to the pool */
+	if (kmsg->msg.type == mtPulse) {
+		hal_spinlockSet(&msg_common.spinlock);
+		LIST_ADD(&msg_common.free, kmsg);
+		hal_spinlockClear(&msg_common.spinlock);
+	}
+}
+
+
+void _proc_msgCancel(port_t *p, kmsg_t *kmsg)
+{
+	if (kmsg->state == msg_notify) {
+		_msg_dequeue(p, kmsg);
+
+		if (kmsg->msg.type == mtPulse)
+			p->pulses--;
+
+		_msg_notifyDone(kmsg);
+	}
+}
+
+
+void _proc_msgDrain(port_t *p)
+{
+	kmsg_t *kmsg;
+
+	while ((kmsg = p->kmessages) != NULL && kmsg->state == msg_notify)
+		_proc_msgCancel(p, kmsg);
+}
+
+
+static int msg_pulseMatch(kmsg_t *kmsg, int code, int value)
+{
+	return kmsg->state == msg_notify && kmsg->msg.type == mtPulse && kmsg->msg.i.pulse.code == code && kmsg->msg.i.pulse.value == value;
+}
+
+
+/* Takes pulse from the pool, allocates new one if the pool is empty */
+static kmsg_t *msg_pulseAlloc(void)
+{
+	kmsg_t *kmsg;
+
+	hal_spinlockSet(&msg_common.spinlock);
+	if ((kmsg = msg_common.free) != NULL)
+		LIST_REMOVE(&msg_common.free, kmsg);
+	hal_spinlockClear(&msg_common.spinlock);
+
+	if (kmsg == NULL && (kmsg = vm_kmalloc(sizeof(kmsg_t))) != NULL) {
+		hal_memset(kmsg, 0, sizeof(kmsg_t));
+		kmsg->msg.type = mtPulse;
+		kmsg->state = msg_received;
+	}
+
+	return kmsg;
+}
+
+
+int proc_pulse(u32 port, int code, int value)
+{
+	port_t *p;
+	kmsg_t *kmsg, *t;
+	int err = EOK;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	/* Pulse is taken in advance, the pool may have to grow */
+	if ((kmsg = msg_pulseAlloc()) == NULL) {
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+
+	hal_spinlockSet(&p->spinlock);
+
+	/* Coalesce with identical pending pulse */
+	if ((t = p->kmessages) != NULL) {
+		while (!msg_pulseMatch(t, code, value) && (t = t->next) != p->kmessages)
+			;
+	}
+
+	if (t == NULL || !msg_pulseMatch(t, code, value)) {
+		/* Port nobody drains can't use up pulses of others */
+		if (p->pulses >= MSG_PORTPULSES) {
+			err = -ENOSPC;
+		}
+		else {
+			kmsg->msg.pid = (proc_current()->process != NULL) ? proc_current()->process->id : 0;
+			kmsg->msg.i.pulse.code = code;
+			kmsg->msg.i.pulse.value = value;
+
+			if ((err = _proc_msgNotify(p, kmsg)) == EOK) {
+				p->pulses++;
+				kmsg = NULL;
+			}
+		}
+	}
+
+	/* Unused pulse goes back to the pool */
+	if (kmsg != NULL)
+		_msg_notifyDone(kmsg);
+
+	hal_spinlockClear(&p->spinlock);
+	port_put(p, 0);
+
+	return err;
+}
+
+
+/* Resolves page of sender's buffer, page sender hasn't touched yet is faulted in first */
+static addr_t msg_resolve(int dir, vm_map_t *map, void *vaddr)
+{
+	addr_t pa;
+
+	vaddr = (void *)FLOOR((unsigned long)vaddr);
+
+	if ((pa = pmap_resolve(&map->pmap, vaddr)) == 0 && map != msg_common.kmap) {
+		if (vm_mapForce(map, vaddr, PROT_READ | PROT_USER | (dir ? PROT_WRITE : 0)) == EOK)
+			pa = pmap_resolve(&map->pmap, vaddr);
+	}
+
+	return pa & ~(SIZE_PAGE - 1);
+}
+
+
 static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *from, process_t *to)
 {
 	void *w = NULL, *vaddr;
@@ -40,7 +483,8 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 	vm_map_t *srcmap, *dstmap;
 	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
 	int flags;
-	addr_t bpa, pa, epa;
+	size_t wsz;
+	addr_t pa;
 
 	if ((size == 0) || (data == NULL))
 		return NULL;
@@ -76,8 +520,16 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 	if (srcmap == dstmap && pmap_belongs(&dstmap->pmap, data))
 		return data;
 
-	if ((ml->w = w = vm_mapFind(dstmap, (void *)0, (!!boffs + !!eoffs + n) * SIZE_PAGE, MAP_NOINHERIT, prot)) == NULL)
-		return NULL;
+	wsz = (!!boffs + !!eoffs + n) * SIZE_PAGE;
+
+	/* Use receive window slot, fall back to dedicated map entry */
+	if (to == NULL || wsz > MSG_SLOTSZ || (w = msg_slotAlloc(dstmap, 0)) == NULL) {
+		if ((w = vm_mapFind(dstmap, (void *)0, wsz, MAP_NOINHERIT, prot)) == NULL)
+			return NULL;
+	}
+
+	ml->w = w;
+	ml->wsz = wsz;
 
 	if (pmap_belongs(&srcmap->pmap, data))
 		flags = vm_mapFlags(srcmap, data);
@@ -87,27 +539,31 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 	if (flags < 0)
 		return NULL;
 
-	if (flags & MAP_DEVICE)
+	ml->attr = PGHD_PRESENT | PGHD_WRITE;
+
+	if (flags & MAP_DEVICE) {
 		attr |= PGHD_DEV;
+		ml->attr |= PGHD_DEV;
+	}
 
-	if (flags & MAP_UNCACHED)
+	if (flags & MAP_UNCACHED) {
 		attr |= PGHD_NOT_CACHED;
+		ml->attr |= PGHD_NOT_CACHED;
+	}
 
 	if (boffs > 0) {
 		ml->boffs = boffs;
-		bpa = pmap_resolve(&srcmap->pmap, data) & ~(SIZE_PAGE - 1);
-
-		if ((ml->bp = nbp = vm_pageAlloc(SIZE_PAGE, PAGE_OWNER_APP)) == NULL)
+		if ((ml->bpa = msg_resolve(dir, srcmap, data)) == 0)
 			return NULL;
 
-		if ((ml->bvaddr = vaddr = vm_mmap(msg_common.kmap, (void *)0, NULL, SIZE_PAGE, PROT_READ | PROT_WRITE, (void *)-1, bpa, flags)) == NULL)
+		if ((ml->bp = nbp = vm_pageAlloc(SIZE_PAGE, PAGE_OWNER_APP)) == NULL)
 			return NULL;
 
 		/* Map new page into destination address space */
 		if (page_map(&dstmap->pmap, w, nbp->addr, (attr | PGHD_WRITE) & ~PGHD_USER) < 0)
 			return NULL;
 
-		hal_memcpy(w + boffs, vaddr + boffs, min(size, SIZE_PAGE - boffs));
+		msg_pageCopy(ml->bpa, ml->attr, boffs, w + boffs, min(size, SIZE_PAGE - boffs), 0);
 
 		if (page_map(&dstmap->pmap, w, nbp->addr, attr) < 0)
 			return NULL;
@@ -117,17 +573,15 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 	vaddr = (void *)CEIL((unsigned long)data);
 
 	for (i = 0; i < n; i++, vaddr += SIZE_PAGE) {
-		pa = pmap_resolve(&srcmap->pmap, vaddr) & ~(SIZE_PAGE - 1);
-		if (page_map(&dstmap->pmap, w + (i + !!boffs) * SIZE_PAGE, pa, attr) < 0)
+		if ((pa = msg_resolve(dir, srcmap, vaddr)) == 0 || page_map(&dstmap->pmap, w + (i + !!boffs) * SIZE_PAGE, pa, attr) < 0)
 			return NULL;
 	}
 
-// lib_printf("w=%p bp->addr=%p %p\n", w, nbp->addr, vaddr);
-
 	if (eoffs) {
 		ml->eoffs = eoffs;
 		vaddr = (void *)FLOOR((unsigned long)data + size);
-		epa = pmap_resolve(&srcmap->pmap, vaddr) & ~(SIZE_PAGE - 1);
+		if ((ml->epa = msg_resolve(dir, srcmap, vaddr)) == 0)
+			return NULL;
 
 		if (!boffs || (eoffs >= boffs)) {
 			if ((ml->ep = nep = vm_pageAlloc(SIZE_PAGE, PAGE_OWNER_APP)) == NULL)
@@ -137,14 +591,11 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 			nep = nbp;
 		}
 
-		if ((ml->evaddr = vaddr = vm_mmap(msg_common.kmap, (void *)0, NULL, SIZE_PAGE, PROT_READ | PROT_WRITE, (void *)-1, epa, flags)) == NULL)
-			return NULL;
-
 		/* Map new page into destination address space */
 		if (page_map(&dstmap->pmap, w + (n + !!boffs) * SIZE_PAGE, nep->addr, (attr | PGHD_WRITE) & ~PGHD_USER) < 0)
 			return NULL;
 
-		hal_memcpy(w + (n + !!boffs) * SIZE_PAGE, vaddr, eoffs);
+		msg_pageCopy(ml->epa, ml->attr, 0, w + (n + !!boffs) * SIZE_PAGE, eoffs, 0);
 
 		if (page_map(&dstmap->pmap, w + (n + !!boffs) * SIZE_PAGE, nep->addr, attr) < 0)
 			return NULL;
@@ -154,47 +605,222 @@ static void *msg_map(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *
 }
 
 
+/* Copies payload range between window and sender's segments, source page by source page */
+static int msg_iovCopy(struct _kmsg_layout_t *ml, int dir, vm_map_t *srcmap, size_t start, size_t end, int topage)
+{
+	unsigned int k;
+	size_t koffs, len;
+	void *src;
+	addr_t pa;
+
+	for (k = 0, koffs = 0; k < ml->iovcnt && start < end; koffs += ml->iov[k++].size) {
+		while (start < end && start < koffs + ml->iov[k].size) {
+			src = ml->iov[k].data + (start - koffs);
+			len = min(min(end, koffs + ml->iov[k].size) - start, SIZE_PAGE - ((unsigned long)src & (SIZE_PAGE - 1)));
+
+			if ((pa = msg_resolve(dir, srcmap, src)) == 0)
+				return -EFAULT;
+
+			msg_pageCopy(pa, ml->attr, (unsigned long)src & (SIZE_PAGE - 1), ml->w + ml->boffs + start, len, topage);
+			start += len;
+		}
+	}
+
+	return EOK;
+}
+
+
+/* Maps vectored payload into contiguous window, whole pages of segment aligned with window are mapped directly */
+static void *msg_mapv(int dir, kmsg_t *kmsg, size_t size, process_t *from, process_t *to)
+{
+	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
+	vm_map_t *srcmap = (from == NULL) ? msg_common.kmap : from->mapp;
+	vm_map_t *dstmap = (to == NULL) ? msg_common.kmap : to->mapp;
+	size_t offs, moffs = 0, koffs = 0, start, end, wsz;
+	unsigned int i, j, k = 0, m = 0, attr, prot;
+	void *w = NULL, *src;
+	addr_t pa;
+
+	attr = PGHD_PRESENT;
+	prot = PROT_READ;
+
+	if (dir) {
+		attr |= PGHD_WRITE;
+		prot |= PROT_WRITE;
+	}
+
+	if (to != NULL) {
+		attr |= PGHD_USER;
+		prot |= PROT_USER;
+	}
+
+	/* Window is aligned with the biggest segment, the rest is copied if it doesn't match */
+	for (i = 0, offs = 0; i < ml->iovcnt; offs += ml->iov[i++].size) {
+		if (ml->iov[i].size > ml->iov[m].size) {
+			m = i;
+			moffs = offs;
+		}
+	}
+
+	ml->boffs = ((unsigned long)ml->iov[m].data - moffs) & (SIZE_PAGE - 1);
+	wsz = CEIL(ml->boffs + size);
+
+	if (to == NULL || wsz > MSG_SLOTSZ || (w = msg_slotAlloc(dstmap, 0)) == NULL) {
+		if ((w = vm_mapFind(dstmap, (void *)0, wsz, MAP_NOINHERIT, prot)) == NULL)
+			return NULL;
+	}
+
+	ml->w = w;
+	ml->wsz = wsz;
+	ml->attr = PGHD_PRESENT | PGHD_WRITE;
+
+	if ((ml->pages = vm_kmalloc(wsz / SIZE_PAGE * sizeof(page_t *))) == NULL)
+		return NULL;
+
+	hal_memset(ml->pages, 0, wsz / SIZE_PAGE * sizeof(page_t *));
+
+	for (j = 0; j < wsz / SIZE_PAGE; j++) {
+		start = max(j * SIZE_PAGE, ml->boffs) - ml->boffs;
+		end = min((j + 1) * SIZE_PAGE, ml->boffs + size) - ml->boffs;
+
+		while (start >= koffs + ml->iov[k].size) {
+			koffs += ml->iov[k].size;
+			k++;
+		}
+
+		src = ml->iov[k].data + (start - koffs);
+
+		/* Whole page of single segment */
+		if (end - start == SIZE_PAGE && end <= koffs + ml->iov[k].size && !((unsigned long)src & (SIZE_PAGE - 1))) {
+			if ((pa = msg_resolve(dir, srcmap, src)) == 0 || page_map(&dstmap->pmap, w + j * SIZE_PAGE, pa, attr) < 0)
+				return NULL;
+
+			continue;
+		}
+
+		if ((ml->pages[j] = vm_pageAlloc(SIZE_PAGE, PAGE_OWNER_APP)) == NULL)
+			return NULL;
+
+		if (page_map(&dstmap->pmap, w + j * SIZE_PAGE, ml->pages[j]->addr, (attr | PGHD_WRITE) & ~PGHD_USER) < 0)
+			return NULL;
+
+		if (msg_iovCopy(ml, dir, srcmap, start, end, 0) < 0)
+			return NULL;
+
+		if (page_map(&dstmap->pmap, w + j * SIZE_PAGE, ml->pages[j]->addr, attr) < 0)
+			return NULL;
+	}
+
+	return w + ml->boffs;
+}
+
+
+/* Copies output written by receiver to shadow pages back to sender's segments */
+static void msg_iovRespond(kmsg_t *kmsg)
+{
+	struct _kmsg_layout_t *ml = &kmsg->o;
+	vm_map_t *srcmap = (kmsg->src == NULL) ? msg_common.kmap : kmsg->src->mapp;
+	size_t start, end;
+	unsigned int j;
+
+	for (j = 0; j < ml->wsz / SIZE_PAGE; j++) {
+		if (ml->pages[j] == NULL)
+			continue;
+
+		start = max(j * SIZE_PAGE, ml->boffs) - ml->boffs;
+		end = min((j + 1) * SIZE_PAGE, ml->boffs + kmsg->msg.o.size) - ml->boffs;
+		msg_iovCopy(ml, 1, srcmap, start, end, 1);
+	}
+}
+
+
+static void msg_pagesFree(struct _kmsg_layout_t *ml)
+{
+	unsigned int j;
+
+	if (ml->pages == NULL)
+		return;
+
+	for (j = 0; j < ml->wsz / SIZE_PAGE; j++) {
+		if (ml->pages[j] != NULL)
+			vm_pageFree(ml->pages[j]);
+	}
+
+	vm_kfree(ml->pages);
+	ml->pages = NULL;
+}
+
+
+/* Copies small payload to receiver through kernel buffer, maps it otherwise */
+static void *msg_inline(int dir, kmsg_t *kmsg, void *data, size_t size, process_t *from, process_t *to)
+{
+	struct _kmsg_layout_t *ml = dir ? &kmsg->o : &kmsg->i;
+	void *w;
+
+	if (ml->iov != NULL)
+		return msg_mapv(dir, kmsg, size, from, to);
+
+	if (ml->kbuf == NULL)
+		return msg_map(dir, kmsg, data, size, from, to);
+
+	if (to == NULL)
+		return ml->kbuf;
+
+	/* Kernel buffer is mapped if it doesn't fit into inline slot */
+	if (size > MSG_INLINESZ || (w = msg_slotAlloc(to->mapp, 1)) == NULL)
+		return msg_map(dir, kmsg, ml->kbuf, size, NULL, to);
+
+	ml->w = w;
+	ml->wsz = MSG_INLINESZ;
+
+	/* Slot still holds previous payload, output is initialized from sender's buffer */
+	hal_memcpy(w, ml->kbuf, size);
+
+	return w;
+}
+
+
 static void msg_release(kmsg_t *kmsg)
 {
 	process_t *process;
 
 	if (kmsg->i.bp != NULL) {
 		vm_pageFree(kmsg->i.bp);
-		vm_munmap(msg_common.kmap, kmsg->i.bvaddr, SIZE_PAGE);
 		kmsg->i.bp = NULL;
 	}
 
 	if (kmsg->i.eoffs) {
 		if (kmsg->i.ep != NULL)
 			vm_pageFree(kmsg->i.ep);
-		vm_munmap(msg_common.kmap, kmsg->i.evaddr, SIZE_PAGE);
 		kmsg->i.eoffs = 0;
 		kmsg->i.ep = NULL;
 	}
 
+	msg_pagesFree(&kmsg->i);
+
 	if (kmsg->i.w != NULL) {
 		if ((process = proc_current()->process) != NULL)
-			vm_munmap(process->mapp, kmsg->i.w, CEIL((unsigned long)kmsg->msg.i.data + kmsg->msg.i.size) - FLOOR((unsigned long)kmsg->msg.i.data));
+			msg_unmap(process->mapp, kmsg->i.w, kmsg->i.wsz);
 		kmsg->i.w = NULL;
 	}
 
 	if (kmsg->o.bp != NULL) {
 		vm_pageFree(kmsg->o.bp);
-		vm_munmap(msg_common.kmap, kmsg->o.bvaddr, SIZE_PAGE);
 		kmsg->o.bp = NULL;
 	}
 
 	if (kmsg->o.eoffs) {
 		if (kmsg->o.ep != NULL)
 			vm_pageFree(kmsg->o.ep);
-		vm_munmap(msg_common.kmap, kmsg->o.evaddr, SIZE_PAGE);
 		kmsg->o.eoffs = 0;
 		kmsg->o.ep = NULL;
 	}
 
+	msg_pagesFree(&kmsg->o);
+
 	if (kmsg->o.w != NULL) {
 		if ((process = proc_current()->process) != NULL)
-			vm_munmap(process->mapp, kmsg->o.w, CEIL((unsigned long)kmsg->msg.o.data + kmsg->msg.o.size) - FLOOR((unsigned long)kmsg->msg.o.data));
+			msg_unmap(process->mapp, kmsg->o.w, kmsg->o.wsz);
 		kmsg->o.w = NULL;
 	}
 }
@@ -283,6 +909,7 @@ static int msg_opack(kmsg_t *kmsg)
 
 		case mtSetAttr:
 		case mtGetAttr:
+		case mtGetAttrAll:
 			offset = sizeof(kmsg->msg.o.attr);
 			break;
 
@@ -304,121 +931,288 @@ static int msg_opack(kmsg_t *kmsg)
 }
 
 
-int proc_send(u32 port, msg_t *msg)
+static int msg_send(u32 port, msg_t *msg, const msgiov_t *iiov, unsigned int iiovcnt, const msgiov_t *oiov, unsigned int oiovcnt, time_t timeout)
 {
 	port_t *p;
-	int err = EOK;
-	kmsg_t kmsg;
+	int err = EOK, abandoned = 0;
+	kmsg_t skmsg, *kmsg = &skmsg;
 	thread_t *sender;
+	time_t deadline = 0;
+	void *odata;
 
-	if ((p = proc_portGet(port)) == NULL)
+	/* Notifications are generated by kernel only */
+	if (msg->type == mtRing || msg->type == mtPulse)
 		return -EINVAL;
 
 	sender = proc_current();
 
-	hal_memcpy(&kmsg.msg, msg, sizeof(msg_t));
-	kmsg.src = sender->process;
-	kmsg.threads = NULL;
-	kmsg.state = msg_waiting;
+	/* Message of timed send may outlive the sender */
+	if (timeout) {
+		if ((kmsg = vm_kmalloc(sizeof(kmsg_t))) == NULL)
+			return -ENOMEM;
 
-	kmsg.msg.pid = (sender->process != NULL) ? sender->process->id : 0;
-	kmsg.msg.priority = sender->priority;
+		if (sender->process != NULL)
+			proc_get(sender->process);
 
-	msg_ipack(&kmsg);
+		deadline = proc_uptime() + timeout;
+	}
 
-	hal_spinlockSet(&p->spinlock);
+	hal_memcpy(&kmsg->msg, msg, sizeof(msg_t));
+	kmsg->src = sender->process;
+	kmsg->threads = NULL;
+	kmsg->state = msg_waiting;
+	kmsg->timed = (timeout != 0);
+	kmsg->stamp = proc_uptime();
+	kmsg->i.kbuf = NULL;
+	kmsg->o.kbuf = NULL;
+	kmsg->i.iov = NULL;
+	kmsg->o.iov = NULL;
 
-	if (p->closed) {
+	kmsg->msg.pid = (sender->process != NULL) ? sender->process->id : 0;
+	kmsg->msg.priority = sender->priority;
+
+	if (iiov != NULL)
+		err = msg_gather(0, kmsg, iiov, iiovcnt);
+
+	if (err == EOK && oiov != NULL)
+		err = msg_gather(1, kmsg, oiov, oiovcnt);
+
+	msg_ipack(kmsg);
+
+	if (iiov == NULL)
+		msg_kbuf(0, kmsg);
+
+	if (oiov == NULL)
+		msg_kbuf(1, kmsg);
+
+	/* Receiver may outlive timed out sender, its pages are never mapped */
+	if (err == EOK && timeout && (!msg_bounced(0, kmsg) || !msg_bounced(1, kmsg)))
+		err = -ENOMEM;
+
+	if (err == EOK && (p = proc_portGet(port)) == NULL)
 		err = -EINVAL;
-	}
-	else {
-		LIST_ADD(&p->kmessages, &kmsg);
-		proc_threadWakeup(&p->threads);
 
-		while (kmsg.state != msg_responded && kmsg.state != msg_rejected) {
-			err = proc_threadWaitInterruptible(&kmsg.threads, &p->spinlock, 0);
+	if (err == EOK) {
+		hal_spinlockSet(&p->spinlock);
 
-			if ((err != EOK && kmsg.state == msg_waiting)) {
-				LIST_REMOVE(&p->kmessages, &kmsg);
-				break;
+		if (p->closed) {
+			err = -EINVAL;
+		}
+		else {
+			_msg_enqueue(p, kmsg);
+
+			/* Receiver blocked on the port runs in place of the sender */
+			err = proc_threadWaitHandoff(&kmsg->threads, &p->spinlock, &p->threads, timeout);
+
+			while (kmsg->state != msg_responded && kmsg->state != msg_rejected) {
+				if ((err != EOK && kmsg->state == msg_waiting)) {
+					_msg_dequeue(p, kmsg);
+					break;
+				}
+
+				/* Message being served is left to the receiver */
+				if (err == -ETIME) {
+					kmsg->state = msg_abandoned;
+					abandoned = 1;
+					break;
+				}
+
+				err = proc_threadWaitUntil(&kmsg->threads, &p->spinlock, deadline);
 			}
+
+			if (kmsg->state == msg_responded)
+				err = EOK; /* Don't report EINTR if we got the response already */
 		}
 
-		if (kmsg.state == msg_responded)
-			err = EOK; /* Don't report EINTR if we got the response already */
+		hal_spinlockClear(&p->spinlock);
+
+		/* Receiver releases message, its port and sender */
+		if (abandoned)
+			return -ETIME;
+
+		port_put(p, 0);
 	}
 
-	hal_spinlockClear(&p->spinlock);
-	port_put(p, 0);
+	if (kmsg->i.kbuf != NULL)
+		vm_kfree(kmsg->i.kbuf);
 
-	if (err != EOK)
-		return err;
+	if (kmsg->i.iov != NULL)
+		vm_kfree(kmsg->i.iov);
+
+	if (err == EOK) {
+		hal_memcpy(msg->o.raw, kmsg->msg.o.raw, sizeof(msg->o.raw));
 
-	hal_memcpy(msg->o.raw, kmsg.msg.o.raw, sizeof(msg->o.raw));
+		/* If msg.o.data has been packed to msg.o.raw */
+		if ((kmsg->msg.o.data > (void *)kmsg->msg.o.raw) && (kmsg->msg.o.data < (void *)kmsg->msg.o.raw + sizeof(kmsg->msg.o.raw)))
+			odata = kmsg->msg.o.data;
+		else if (kmsg->state == msg_responded)
+			odata = kmsg->o.kbuf;
+		else
+			odata = NULL;
 
-	/* If msg.o.data has been packed to msg.o.raw */
-	if ((kmsg.msg.o.data > (void *)kmsg.msg.o.raw) && (kmsg.msg.o.data < (void *)kmsg.msg.o.raw + sizeof(kmsg.msg.o.raw)))
-		hal_memcpy(msg->o.data, kmsg.msg.o.data, msg->o.size);
+		if (odata != NULL && oiov != NULL)
+			msg_scatter(odata, kmsg->msg.o.size, oiov, oiovcnt);
+		else if (odata != NULL)
+			hal_memcpy(msg->o.data, odata, msg->o.size);
+	}
 
-	return kmsg.state == msg_rejected ? -EINVAL : err;
+	if (kmsg->o.kbuf != NULL)
+		vm_kfree(kmsg->o.kbuf);
+
+	if (kmsg->o.iov != NULL)
+		vm_kfree(kmsg->o.iov);
+
+	if (err == EOK && kmsg->state == msg_rejected)
+		err = -EINVAL;
+
+	if (kmsg != &skmsg) {
+		if (sender->process != NULL)
+			proc_put(sender->process);
+
+		vm_kfree(kmsg);
+	}
+
+	return err;
 }
 
 
-int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
+int proc_send(u32 port, msg_t *msg)
 {
-	port_t *p;
-	kmsg_t *kmsg;
-	int ipacked = 0, opacked = 0, closed, err = EOK;
+	return msg_send(port, msg, NULL, 0, NULL, 0, 0);
+}
 
-	if ((p = proc_portGet(port)) == NULL)
-		return -EINVAL;
+
+int proc_sendTimed(u32 port, msg_t *msg, time_t timeout)
+{
+	return msg_send(port, msg, NULL, 0, NULL, 0, timeout);
+}
+
+
+int proc_sendv(u32 port, msg_t *msg, const msgiov_t *iiov, unsigned int iiovcnt, const msgiov_t *oiov, unsigned int oiovcnt)
+{
+	return msg_send(port, msg, iiov, iiovcnt, oiov, oiovcnt, 0);
+}
+
+
+/* Releases message abandoned by timed out sender, receiver's windows are already gone */
+static void msg_free(kmsg_t *kmsg)
+{
+	if (kmsg->i.bp != NULL)
+		vm_pageFree(kmsg->i.bp);
+
+	if (kmsg->i.ep != NULL)
+		vm_pageFree(kmsg->i.ep);
+
+	if (kmsg->o.bp != NULL)
+		vm_pageFree(kmsg->o.bp);
+
+	if (kmsg->o.ep != NULL)
+		vm_pageFree(kmsg->o.ep);
+
+	if (kmsg->i.kbuf != NULL)
+		vm_kfree(kmsg->i.kbuf);
+
+	if (kmsg->o.kbuf != NULL)
+		vm_kfree(kmsg->o.kbuf);
+
+	if (kmsg->src != NULL)
+		proc_put(kmsg->src);
+
+	port_put(kmsg->port, 0);
+	vm_kfree(kmsg);
+}
+
+
+/* Responds to reply (if any) and receives next message, client is switched to if port is empty and wait is set */
+static int msg_recv(port_t *p, msg_t *msg, unsigned int *rid, kmsg_t *reply, int wait, time_t deadline)
+{
+	kmsg_t *kmsg;
+	msg_t notify;
+	int ipacked = 0, opacked = 0, closed, notified = 0, abandoned, err = EOK;
 
 	hal_spinlockSet(&p->spinlock);
 
-	while (p->kmessages == NULL && !p->closed && err != -EINTR)
-		err = proc_threadWaitInterruptible(&p->threads, &p->spinlock, 0);
+	if (reply != NULL) {
+		proc_threadBoost(-1);
+		LIST_REMOVE(&p->received, reply);
+		_msg_statRespond(p, reply);
+		reply->state = msg_responded;
+		reply->src = proc_current()->process;
+
+		if (p->kmessages == NULL && !p->closed && wait)
+			err = proc_threadWaitHandoff(&p->threads, &p->spinlock, &reply->threads, 0);
+		else
+			proc_threadWakeup(&reply->threads);
+	}
+
+	while (p->kmessages == NULL && !p->closed && err == EOK) {
+		if (wait)
+			err = proc_threadWaitUntil(&p->threads, &p->spinlock, deadline);
+		else
+			err = -EAGAIN;
+	}
 
 	kmsg = p->kmessages;
 
 	if (p->closed) {
 		/* Port is being removed */
-		if (kmsg != NULL) {
+		if (kmsg != NULL && kmsg->state == msg_notify) {
+			_proc_msgCancel(p, kmsg);
+		}
+		else if (kmsg != NULL) {
 			kmsg->state = msg_rejected;
-			LIST_REMOVE(&p->kmessages, kmsg);
+			_msg_dequeue(p, kmsg);
 			proc_threadWakeup(&kmsg->threads);
 		}
 
 		err = -EINVAL;
 	}
+	else if (err == EOK && kmsg->state == msg_notify) {
+		/* Notification may be queued again once it is removed */
+		hal_memcpy(&notify, &kmsg->msg, sizeof(notify));
+		_proc_msgCancel(p, kmsg);
+		_port_statRecv(p, 0);
+		notified = 1;
+	}
 	else if (err == EOK) {
-		LIST_REMOVE(&p->kmessages, kmsg);
+		_msg_dequeue(p, kmsg);
 		kmsg->state = msg_received;
+		LIST_ADD(&p->received, kmsg);
+		kmsg->stamp = _port_statRecv(p, kmsg->stamp);
 	}
 	hal_spinlockClear(&p->spinlock);
 
-	if (err != EOK) {
-		port_put(p, 0);
+	if (err != EOK)
 		return err;
+
+	if (notified) {
+		*rid = 0;
+		hal_memcpy(msg, &notify, sizeof(*msg));
+		return EOK;
 	}
 
 	/* (MOD) */
 	(*rid) = (unsigned long)(kmsg);
 
-	kmsg->i.bvaddr = NULL;
+	kmsg->i.bpa = 0;
 	kmsg->i.boffs = 0;
 	kmsg->i.w = NULL;
+	kmsg->i.wsz = 0;
 	kmsg->i.bp = NULL;
-	kmsg->i.evaddr = NULL;
+	kmsg->i.epa = 0;
 	kmsg->i.eoffs = 0;
 	kmsg->i.ep = NULL;
+	kmsg->i.pages = NULL;
 
-	kmsg->o.bvaddr = NULL;
+	kmsg->o.bpa = 0;
 	kmsg->o.boffs = 0;
 	kmsg->o.w = NULL;
+	kmsg->o.wsz = 0;
 	kmsg->o.bp = NULL;
-	kmsg->o.evaddr = NULL;
+	kmsg->o.epa = 0;
 	kmsg->o.eoffs = 0;
 	kmsg->o.ep = NULL;
+	kmsg->o.pages = NULL;
 
 	if ((kmsg->msg.i.data > (void *)kmsg->msg.i.raw) && (kmsg->msg.i.data < (void *)kmsg->msg.i.raw + sizeof(kmsg->msg.i.raw)))
 		ipacked = 1;
@@ -426,10 +1220,10 @@ int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
 	/* Map data in receiver space */
 	/* Don't map if msg is packed */
 	if (!ipacked)
-		kmsg->msg.i.data = msg_map(0, kmsg, kmsg->msg.i.data, kmsg->msg.i.size, kmsg->src, proc_current()->process);
+		kmsg->msg.i.data = msg_inline(0, kmsg, kmsg->msg.i.data, kmsg->msg.i.size, kmsg->src, proc_current()->process);
 
 	if (!(opacked = msg_opack(kmsg)))
-		kmsg->msg.o.data = msg_map(1, kmsg, kmsg->msg.o.data, kmsg->msg.o.size, kmsg->src, proc_current()->process);
+		kmsg->msg.o.data = msg_inline(1, kmsg, kmsg->msg.o.data, kmsg->msg.o.size, kmsg->src, proc_current()->process);
 
 	if ((kmsg->msg.i.size && kmsg->msg.i.data == NULL) ||
 		(kmsg->msg.o.size && kmsg->msg.o.data == NULL) ||
@@ -438,15 +1232,22 @@ int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
 		msg_release(kmsg);
 
 		hal_spinlockSet(&p->spinlock);
-		kmsg->state = msg_rejected;
-		proc_threadWakeup(&kmsg->threads);
+		LIST_REMOVE(&p->received, kmsg);
+		if (!(abandoned = (kmsg->state == msg_abandoned))) {
+			kmsg->state = msg_rejected;
+			proc_threadWakeup(&kmsg->threads);
+		}
 		hal_spinlockClear(&p->spinlock);
 
-		port_put(p, 0);
+		if (abandoned)
+			msg_free(kmsg);
 
 		return closed ? -EINVAL : -ENOMEM;
 	}
 
+	/* Serve message with priority of its sender */
+	proc_threadBoost(kmsg->msg.priority);
+
 	hal_memcpy(msg, &kmsg->msg, sizeof(*msg));
 
 	if (ipacked)
@@ -455,50 +1256,221 @@ int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
 	if (opacked)
 		msg->o.data = msg->o.raw + (kmsg->msg.o.data - (void *)kmsg->msg.o.raw);
 
-	port_put(p, 0);
 	return EOK;
 }
 
 
-int proc_respond(u32 port, msg_t *msg, unsigned int rid)
+/* Copies response to the sender, kmsg is still owned by the receiver */
+static void msg_respond(kmsg_t *kmsg, msg_t *msg)
 {
-	port_t *p;
-	size_t s = 0;
-	kmsg_t *kmsg = (kmsg_t *)(unsigned long)rid;
-
-	if ((p = proc_portGet(port)) == NULL)
-		return -EINVAL;
-
 	/* Copy shadow pages */
 	if (kmsg->i.bp != NULL)
-		hal_memcpy(kmsg->i.bvaddr + kmsg->i.boffs, kmsg->i.w + kmsg->i.boffs, min(SIZE_PAGE - kmsg->i.boffs, kmsg->msg.i.size));
+		msg_pageCopy(kmsg->i.bpa, kmsg->i.attr, kmsg->i.boffs, kmsg->i.w + kmsg->i.boffs, min(SIZE_PAGE - kmsg->i.boffs, kmsg->msg.i.size), 1);
 
 	if (kmsg->i.eoffs)
-		hal_memcpy(kmsg->i.evaddr, kmsg->i.w + kmsg->i.boffs + kmsg->msg.i.size - kmsg->i.eoffs, kmsg->i.eoffs);
+		msg_pageCopy(kmsg->i.epa, kmsg->i.attr, 0, kmsg->i.w + kmsg->i.boffs + kmsg->msg.i.size - kmsg->i.eoffs, kmsg->i.eoffs, 1);
 
 	if (kmsg->o.bp != NULL)
-		hal_memcpy(kmsg->o.bvaddr + kmsg->o.boffs, kmsg->o.w + kmsg->o.boffs, min(SIZE_PAGE - kmsg->o.boffs, kmsg->msg.o.size));
+		msg_pageCopy(kmsg->o.bpa, kmsg->o.attr, kmsg->o.boffs, kmsg->o.w + kmsg->o.boffs, min(SIZE_PAGE - kmsg->o.boffs, kmsg->msg.o.size), 1);
 
 	if (kmsg->o.eoffs)
-		hal_memcpy(kmsg->o.evaddr, kmsg->o.w + kmsg->o.boffs + kmsg->msg.o.size - kmsg->o.eoffs, kmsg->o.eoffs);
+		msg_pageCopy(kmsg->o.epa, kmsg->o.attr, 0, kmsg->o.w + kmsg->o.boffs + kmsg->msg.o.size - kmsg->o.eoffs, kmsg->o.eoffs, 1);
+
+	if (kmsg->o.pages != NULL)
+		msg_iovRespond(kmsg);
+
+	/* Copy inline output back to kernel buffer */
+	if (kmsg->o.kbuf != NULL && kmsg->o.w != NULL && msg_inlineSlot(proc_current()->process->mapp, kmsg->o.w))
+		hal_memcpy(kmsg->o.kbuf, kmsg->o.w, kmsg->msg.o.size);
 
 	msg_release(kmsg);
 
 	hal_memcpy(kmsg->msg.o.raw, msg->o.raw, sizeof(msg->o.raw));
 
+	/* Sender mustn't see lookup results preceding its request */
+	proc_dcacheUpdate(kmsg->port->id, kmsg->msg.type);
+}
+
+
+/* Receives next message from set or any of its members */
+static int msg_setRecv(port_t *set, msg_t *msg, unsigned int *rid, time_t deadline)
+{
+	port_t *m;
+	unsigned int gen;
+	int err;
+
+	do {
+		gen = port_setGen(set);
+
+		if ((m = port_setSelect(set)) != NULL) {
+			err = msg_recv(m, msg, rid, NULL, 0, 0);
+			port_put(m, 0);
+
+			/* Member being removed is skipped */
+			if (err != -EAGAIN && (err != -EINVAL || m == set))
+				return err;
+		}
+	} while ((err = port_setWait(set, gen, deadline)) == EOK);
+
+	return err;
+}
+
+
+/* Wakes sender up, message may have been received through port set */
+static void msg_wake(kmsg_t *kmsg)
+{
+	port_t *p = kmsg->port;
+
+	proc_threadBoost(-1);
+
 	hal_spinlockSet(&p->spinlock);
+	LIST_REMOVE(&p->received, kmsg);
+	_msg_statRespond(p, kmsg);
+
+	if (kmsg->state == msg_abandoned) {
+		hal_spinlockClear(&p->spinlock);
+		msg_free(kmsg);
+		return;
+	}
+
 	kmsg->state = msg_responded;
 	kmsg->src = proc_current()->process;
-	proc_threadWakeup(&kmsg->threads);
+	proc_threadWakeupHandoff(&kmsg->threads, &p->spinlock);
+}
+
+
+void proc_msgReclaim(port_t *p)
+{
+	kmsg_t *kmsg, *abandoned = NULL;
+
+	hal_spinlockSet(&p->spinlock);
+	do {
+		if ((kmsg = p->received) != NULL) {
+			while (kmsg->state != msg_abandoned && (kmsg = kmsg->next) != p->received)
+				;
+
+			if (kmsg->state != msg_abandoned)
+				kmsg = NULL;
+		}
+
+		if (kmsg != NULL) {
+			LIST_REMOVE(&p->received, kmsg);
+			LIST_ADD(&abandoned, kmsg);
+		}
+	} while (kmsg != NULL);
 	hal_spinlockClear(&p->spinlock);
+
+	/* Each message holds port reference, port can't be freed here */
+	while ((kmsg = abandoned) != NULL) {
+		LIST_REMOVE(&abandoned, kmsg);
+		msg_free(kmsg);
+	}
+}
+
+
+int proc_recvTimed(u32 port, msg_t *msg, unsigned int *rid, time_t timeout)
+{
+	port_t *p;
+	time_t deadline = 0;
+	int err;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	if (timeout)
+		deadline = proc_uptime() + timeout;
+
+	if (p->members != NULL)
+		err = msg_setRecv(p, msg, rid, deadline);
+	else
+		err = msg_recv(p, msg, rid, NULL, 1, deadline);
+
+	port_put(p, 0);
+	return err;
+}
+
+
+int proc_recv(u32 port, msg_t *msg, unsigned int *rid)
+{
+	return proc_recvTimed(port, msg, rid, 0);
+}
+
+
+int proc_respond(u32 port, msg_t *msg, unsigned int rid)
+{
+	port_t *p;
+	size_t s = 0;
+	kmsg_t *kmsg = (kmsg_t *)(unsigned long)rid;
+
+	/* Notifications need no response */
+	if (kmsg == NULL)
+		return -EINVAL;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	msg_respond(kmsg, msg);
+	msg_wake(kmsg);
+
 	port_put(p, 0);
 
 	return s;
 }
 
 
+int proc_respondAndRecv(u32 port, msg_t *msg, unsigned int *rid)
+{
+	port_t *p;
+	kmsg_t *reply = (kmsg_t *)(unsigned long)(*rid);
+	int err;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	if (reply != NULL)
+		msg_respond(reply, msg);
+
+	/* Direct switch to the client is possible only if reply came through this port and client still waits */
+	if (p->members != NULL || (reply != NULL && (reply->port != p || reply->timed))) {
+		if (reply != NULL)
+			msg_wake(reply);
+
+		if (p->members != NULL)
+			err = msg_setRecv(p, msg, rid, 0);
+		else
+			err = msg_recv(p, msg, rid, NULL, 1, 0);
+	}
+	else {
+		err = msg_recv(p, msg, rid, reply, 1, 0);
+	}
+
+	port_put(p, 0);
+	return err;
+}
+
+
 void _msg_init(vm_map_t *kmap, vm_object_t *kernel)
 {
+	unsigned int i, n = hal_cpuGetCount();
+
 	msg_common.kmap = kmap;
 	msg_common.kernel = kernel;
+
+	hal_spinlockCreate(&msg_common.spinlock, "msg_common.spinlock");
+	msg_common.free = NULL;
+
+	for (i = 0; i < MSG_PULSES; i++) {
+		hal_memset(&msg_common.pulses[i], 0, sizeof(kmsg_t));
+		msg_common.pulses[i].msg.type = mtPulse;
+		msg_common.pulses[i].state = msg_received;
+		LIST_ADD(&msg_common.free, &msg_common.pulses[i]);
+	}
+
+	if ((msg_common.windows = vm_kmalloc(n * sizeof(msg_window_t))) == NULL)
+		return;
+
+	for (i = 0; i < n; i++) {
+		hal_spinlockCreate(&msg_common.windows[i].spinlock, "msg_common.windows[].spinlock");
+		msg_common.windows[i].vaddr = vm_mapFind(kmap, NULL, SIZE_PAGE, MAP_NONE, PROT_READ | PROT_WRITE);
+	}
 }
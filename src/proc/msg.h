@@ -22,6 +22,9 @@
 #include "threads.h"
 
 
+struct _port_t;
+
+
 typedef struct _kmsg_t {
 #ifndef NOMMU
 	msg_t msg;
@@ -33,17 +36,31 @@ typedef struct _kmsg_t {
 	struct _kmsg_t *prev;
 	thread_t *threads;
 	process_t *src;
+	struct _port_t *port;
+	time_t stamp;
+	int timed;
 	volatile int state;
 #ifndef NOMMU
 	struct _kmsg_layout_t {
-		void *bvaddr;
+		addr_t bpa;
 		u64 boffs;
 		void *w;
+		size_t wsz;
 		page_t *bp;
 
-		void *evaddr;
+		addr_t epa;
 		u64 eoffs;
 		page_t *ep;
+
+		int attr;
+
+		/* Kernel copy of small payload */
+		void *kbuf;
+
+		/* Segments of vectored payload, shadow pages by window page (NULL if mapped directly) */
+		msgiov_t *iov;
+		unsigned int iovcnt;
+		page_t **pages;
 	} i, o;
 #endif
 } kmsg_t;
@@ -57,12 +74,54 @@ typedef struct _kmsg_t {
 extern int proc_send(u32 port, msg_t *msg);
 
 
+/* Sends message with payloads gathered from and scattered to segment vectors */
+extern int proc_sendv(u32 port, msg_t *msg, const msgiov_t *iiov, unsigned int iiovcnt, const msgiov_t *oiov, unsigned int oiovcnt);
+
+
+/* Sends message and waits for response at most timeout microseconds, payloads are copied */
+extern int proc_sendTimed(u32 port, msg_t *msg, time_t timeout);
+
+
 extern int proc_recv(u32 port, msg_t *msg, unsigned int *rid);
 
 
+/* Receives message waiting at most timeout microseconds */
+extern int proc_recvTimed(u32 port, msg_t *msg, unsigned int *rid, time_t timeout);
+
+
 extern int proc_respond(u32 port, msg_t *msg, unsigned int rid);
 
 
+/* Responds to message rid and waits for the next one */
+extern int proc_respondAndRecv(u32 port, msg_t *msg, unsigned int *rid);
+
+
+/* Queues one-way notification, identical pending pulse is not queued twice */
+extern int proc_pulse(u32 port, int code, int value);
+
+
+/* Queues notification which needs no response, unless it is already pending, port spinlock is held */
+extern int _proc_msgNotify(struct _port_t *p, kmsg_t *kmsg);
+
+
+/* Removes pending notification, port spinlock is held */
+extern void _proc_msgCancel(struct _port_t *p, kmsg_t *kmsg);
+
+
+/* Removes all pending notifications from port being freed */
+extern void _proc_msgDrain(struct _port_t *p);
+
+
+#ifndef NOMMU
+/* Returns 1 if range overlaps IPC receive windows owned by kernel */
+extern int proc_msgWindow(vm_map_t *map, void *vaddr, size_t size);
+
+
+/* Frees messages abandoned by timed out senders on port whose owner is gone */
+extern void proc_msgReclaim(struct _port_t *p);
+#endif
+
+
 extern void _msg_init(vm_map_t *kmap, vm_object_t *kernel);
 
 
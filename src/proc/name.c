@@ -18,12 +18,26 @@
 #include "../lib/lib.h"
 #include "proc.h"
 
-#define HASH_LEN 5 /* Number of entries in dcache = 2 ^ HASH_LEN */
+#define HASH_LEN      5                   /* Initial number of entries in dcache = 2 ^ HASH_LEN */
+#define HASH_MAXLEN   12                  /* Number of entries dcache may grow up to = 2 ^ HASH_MAXLEN */
+#define DCACHE_MAXSZ  2048                /* Maximal number of cached lookup results */
+#define DCACHE_TTL    (5 * 1000 * 1000)   /* Cached lookup results expire after 5 s */
+#define DCACHE_NEGTTL (1000 * 1000)       /* Negative entries expire after 1 s */
+#define DCACHE_PORTS  64                  /* Cached lookup results are counted per server port hash */
 
 
 typedef struct _dcache_entry_t {
 	struct _dcache_entry_t *next;
+	unsigned int hash;
+
+	/* Registered names have no directory and never expire */
+	int registered;
+	oid_t dir;
+	time_t expires;
+
 	oid_t oid;
+	oid_t dev;
+	int err;
 	char name[];
 } dcache_entry_t;
 
@@ -32,66 +46,330 @@ struct {
 	int root_registered;
 	oid_t root_oid;
 
-	dcache_entry_t *dcache[1 << HASH_LEN];
-	lock_t dcache_lock;
+	dcache_entry_t **dcache;
+	dcache_entry_t *initial[1 << HASH_LEN];
+	unsigned int bits;
+	unsigned int count;
+	unsigned int cached;
+	unsigned int gen;
+	unsigned int ports[DCACHE_PORTS];
+	rwlock_t dcache_lock;
 } name_common;
 
 
 /* Based on ceph_str_hash_linux() */
-static unsigned int dcache_strHash(const char *str)
+static unsigned int dcache_strHash(const char *str, size_t len)
 {
 	unsigned int hash = 0;
 	unsigned char c;
 
-	while ((c = *str++) != '\0')
+	while (len-- && (c = *str++) != '\0')
 		hash += (c << 4) + (c >> 4) * 11;
 
-	return hash & ((1 << HASH_LEN) - 1);
+	return hash;
 }
 
 
-static dcache_entry_t *_dcache_entryLookup(unsigned int hash, const char *name)
+static unsigned int dcache_hash(const oid_t *dir, const char *name, size_t len)
 {
-	dcache_entry_t *entry = name_common.dcache[hash];
+	unsigned int hash = dcache_strHash(name, len);
+
+	if (dir != NULL)
+		hash += dir->port * 31 + (unsigned int)dir->id * 17;
+
+	return hash;
+}
 
-	while (entry != NULL && hal_strcmp(entry->name, name) != 0)
-		entry = entry->next;
+
+static int dcache_oidEqual(const oid_t *oid1, const oid_t *oid2)
+{
+	return oid1->port == oid2->port && oid1->id == oid2->id;
+}
+
+
+/* Looks up registered name (dir is NULL) or lookup result of name relative to dir */
+static dcache_entry_t *_dcache_entryLookup(unsigned int hash, const oid_t *dir, const char *name, size_t len)
+{
+	dcache_entry_t *entry = name_common.dcache[hash & ((1 << name_common.bits) - 1)];
+
+	for (; entry != NULL; entry = entry->next) {
+		if (entry->hash != hash || hal_strncmp(entry->name, name, len) != 0 || entry->name[len] != '\0')
+			continue;
+
+		if (dir == NULL && entry->registered)
+			break;
+
+		if (dir != NULL && !entry->registered && dcache_oidEqual(&entry->dir, dir))
+			break;
+	}
 
 	return entry;
 }
 
 
+static void _dcache_grow(void)
+{
+	dcache_entry_t **dcache, *entry;
+	unsigned int i, bits = name_common.bits + 1;
+
+	if (bits > HASH_MAXLEN || name_common.count <= (2U << name_common.bits))
+		return;
+
+	if ((dcache = vm_kmalloc(sizeof(dcache_entry_t *) << bits)) == NULL)
+		return;
+
+	hal_memset(dcache, 0, sizeof(dcache_entry_t *) << bits);
+
+	for (i = 0; i < (1U << name_common.bits); i++) {
+		while ((entry = name_common.dcache[i]) != NULL) {
+			name_common.dcache[i] = entry->next;
+			entry->next = dcache[entry->hash & ((1 << bits) - 1)];
+			dcache[entry->hash & ((1 << bits) - 1)] = entry;
+		}
+	}
+
+	if (name_common.dcache != name_common.initial)
+		vm_kfree(name_common.dcache);
+
+	name_common.dcache = dcache;
+	name_common.bits = bits;
+}
+
+
+/* Counts lookup results of entry's server, read without lock to skip invalidation of ports with nothing cached */
+static void _dcache_portCount(dcache_entry_t *entry, int n)
+{
+	if (!entry->registered)
+		__atomic_add_fetch(&name_common.ports[entry->dir.port % DCACHE_PORTS], n, __ATOMIC_SEQ_CST);
+}
+
+
+static void _dcache_entryAdd(dcache_entry_t *entry)
+{
+	dcache_entry_t **bucket = &name_common.dcache[entry->hash & ((1 << name_common.bits) - 1)];
+
+	entry->next = *bucket;
+	*bucket = entry;
+
+	name_common.count++;
+	if (!entry->registered)
+		name_common.cached++;
+
+	_dcache_portCount(entry, 1);
+	_dcache_grow();
+}
+
+
+static void _dcache_entryRemove(dcache_entry_t *entry)
+{
+	dcache_entry_t **bucket = &name_common.dcache[entry->hash & ((1 << name_common.bits) - 1)];
+
+	while (*bucket != entry)
+		bucket = &(*bucket)->next;
+
+	*bucket = entry->next;
+
+	name_common.count--;
+	if (!entry->registered)
+		name_common.cached--;
+
+	_dcache_portCount(entry, -1);
+}
+
+
+static int dcache_stale(dcache_entry_t *entry, const u32 *port, int negative, time_t now)
+{
+	if (entry->registered)
+		return 0;
+
+	if (entry->expires <= now)
+		return 1;
+
+	if (negative)
+		return entry->err < 0;
+
+	if (port == NULL)
+		return 1;
+
+	return entry->dir.port == *port;
+}
+
+
+/* Removes expired lookup results and negative ones (negative is set), ones answered by port or all of them (port is NULL) */
+static void _dcache_purge(const u32 *port, int negative)
+{
+	dcache_entry_t **bucket, *entry;
+	time_t now = proc_uptime();
+	unsigned int i;
+
+	for (i = 0; i < (1U << name_common.bits); i++) {
+		for (bucket = &name_common.dcache[i]; (entry = *bucket) != NULL;) {
+			if (!dcache_stale(entry, port, negative, now)) {
+				bucket = &entry->next;
+				continue;
+			}
+
+			*bucket = entry->next;
+			name_common.count--;
+			name_common.cached--;
+			_dcache_portCount(entry, -1);
+			vm_kfree(entry);
+		}
+	}
+}
+
+
+/* Drops lookup results answered by port or all of them (port is NULL), results being queried aren't cached */
+static void dcache_invalidate(const u32 *port)
+{
+	__atomic_add_fetch(&name_common.gen, 1, __ATOMIC_SEQ_CST);
+
+	/* Result added concurrently is counted before its generation is checked */
+	if (port != NULL && __atomic_load_n(&name_common.ports[*port % DCACHE_PORTS], __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	proc_rwLockWrite(&name_common.dcache_lock);
+	_dcache_purge(port, 0);
+	proc_rwLockClear(&name_common.dcache_lock);
+}
+
+
+void proc_dcacheUpdate(u32 port, int type)
+{
+	switch (type) {
+		case mtCreate:
+		case mtDestroy:
+		case mtSetAttr:
+		case mtLink:
+		case mtUnlink:
+			break;
+
+		default:
+			return;
+	}
+
+	dcache_invalidate(&port);
+}
+
+
+/* Caches result of looking name up in dir queried at generation gen, err is set for negative entry */
+static void dcache_add(const oid_t *dir, const char *name, size_t len, const oid_t *oid, const oid_t *dev, int err, unsigned int gen)
+{
+	dcache_entry_t *entry, *old;
+
+	if (len == 0 || (entry = vm_kmalloc(sizeof(dcache_entry_t) + len + 1)) == NULL)
+		return;
+
+	entry->hash = dcache_hash(dir, name, len);
+	entry->registered = 0;
+	entry->dir = *dir;
+	entry->expires = proc_uptime() + (err < 0 ? DCACHE_NEGTTL : DCACHE_TTL);
+	entry->err = err;
+
+	if (err == 0) {
+		entry->oid = *oid;
+		entry->dev = *dev;
+	}
+
+	hal_memcpy(entry->name, name, len);
+	entry->name[len] = '\0';
+
+	proc_rwLockWrite(&name_common.dcache_lock);
+	if ((old = _dcache_entryLookup(entry->hash, dir, name, len)) != NULL) {
+		_dcache_entryRemove(old);
+		vm_kfree(old);
+	}
+
+	if (name_common.cached >= DCACHE_MAXSZ)
+		_dcache_purge(NULL, 1);
+
+	if (name_common.cached < DCACHE_MAXSZ) {
+		_dcache_entryAdd(entry);
+
+		/* Namespace changed while server was queried */
+		if (gen != __atomic_load_n(&name_common.gen, __ATOMIC_SEQ_CST))
+			_dcache_entryRemove(entry);
+		else
+			entry = NULL;
+	}
+	proc_rwLockClear(&name_common.dcache_lock);
+
+	if (entry != NULL)
+		vm_kfree(entry);
+}
+
+
+/* Resolves leading part of path relative to dir from cache, returns its length or error of negative entry */
+static int dcache_resolve(const oid_t *dir, const char *path, size_t len, oid_t *oid, oid_t *dev)
+{
+	dcache_entry_t *entry;
+	time_t now = proc_uptime();
+	int res = 0;
+
+	proc_rwLockRead(&name_common.dcache_lock);
+	while (len > 0) {
+		if ((entry = _dcache_entryLookup(dcache_hash(dir, path, len), dir, path, len)) != NULL && entry->expires > now) {
+			if ((res = entry->err) == 0) {
+				*oid = entry->oid;
+				*dev = entry->dev;
+				res = len;
+			}
+			break;
+		}
+
+		/* Try shorter prefix, missing prefix means missing path as well */
+		while (--len > 0 && path[len] != '/')
+			;
+
+		if (len == 0)
+			break;
+
+		now = proc_uptime();
+		res = 0;
+	}
+	proc_rwLockClear(&name_common.dcache_lock);
+
+	return res;
+}
+
+
 int proc_portRegister(unsigned int port, const char *name, oid_t *oid)
 {
 	dcache_entry_t *entry;
-	unsigned int hash = dcache_strHash(name);
+	size_t len = hal_strlen(name);
 
-	/* Check if entry already exists */
-	proc_lockSet(&name_common.dcache_lock);
-	if (_dcache_entryLookup(hash, name) != NULL) {
-		proc_lockClear(&name_common.dcache_lock);
-		return -EEXIST;
+	if (name[0] == '/' && name[1] == 0) {
+		name_common.root_oid.port = port;
+		name_common.root_oid.id = (oid != NULL) ? oid->id : 0;
+		name_common.root_registered = 1;
+
+		/* Lookups start from new root */
+		dcache_invalidate(NULL);
+		return EOK;
 	}
-	proc_lockClear(&name_common.dcache_lock);
 
-	if ((entry = vm_kmalloc(sizeof(dcache_entry_t) + hal_strlen(name) + 1)) == NULL)
+	if ((entry = vm_kmalloc(sizeof(dcache_entry_t) + len + 1)) == NULL)
 		return -ENOMEM;
 
+	entry->hash = dcache_hash(NULL, name, len);
+	entry->registered = 1;
+	entry->expires = 0;
+	entry->err = 0;
 	entry->oid.port = port;
-	if (oid != NULL)
-		entry->oid.id = oid->id;
+	entry->oid.id = (oid != NULL) ? oid->id : 0;
+	entry->dev = entry->oid;
 	hal_strcpy(entry->name, name);
 
-	if (name[0] == '/' && name[1] == 0) {
-		name_common.root_oid = entry->oid;
-		name_common.root_registered = 1;
-		return EOK;
+	proc_rwLockWrite(&name_common.dcache_lock);
+	/* Check if entry already exists */
+	if (_dcache_entryLookup(entry->hash, NULL, name, len) != NULL) {
+		proc_rwLockClear(&name_common.dcache_lock);
+		vm_kfree(entry);
+		return -EEXIST;
 	}
 
-	proc_lockSet(&name_common.dcache_lock);
-	entry->next = name_common.dcache[hash];
-	name_common.dcache[hash] = entry;
-	proc_lockClear(&name_common.dcache_lock);
+	_dcache_entryAdd(entry);
+	proc_rwLockClear(&name_common.dcache_lock);
 
 	return EOK;
 }
@@ -99,46 +377,70 @@ int proc_portRegister(unsigned int port, const char *name, oid_t *oid)
 
 void proc_portUnregister(const char *name)
 {
-	dcache_entry_t *entry, *prev = NULL;
-	unsigned int hash = dcache_strHash(name);
+	dcache_entry_t *entry;
+	size_t len = hal_strlen(name);
 
-	proc_lockSet(&name_common.dcache_lock);
-	entry = name_common.dcache[hash];
+	proc_rwLockWrite(&name_common.dcache_lock);
+	if ((entry = _dcache_entryLookup(dcache_hash(NULL, name, len), NULL, name, len)) != NULL)
+		_dcache_entryRemove(entry);
+	proc_rwLockClear(&name_common.dcache_lock);
 
-	while (entry != NULL && hal_strcmp(entry->name, name) != 0) {
-		/* Find entry to remove */
-		prev = entry;
-		entry = entry->next;
-	}
+	if (entry != NULL)
+		vm_kfree(entry);
+}
 
-	if (entry == NULL) {
-		/* There is no such entry, nothing to do */
-		proc_lockClear(&name_common.dcache_lock);
-		return;
+
+/* Sends lookup (or combined lookup and open) of path relative to dir to its server */
+static int name_query(msg_t *msg, oid_t *dir, char *path, size_t len, int flags, int open, oid_t *fil, oid_t *dev)
+{
+	int err;
+
+	hal_memset(msg, 0, sizeof(msg_t));
+	msg->i.size = len + 1;
+	msg->i.data = path;
+
+	if (open) {
+		msg->type = mtOpenPath;
+		msg->i.openpath.dir = *dir;
+		msg->i.openpath.flags = flags;
 	}
+	else {
+		msg->type = mtLookup;
+		msg->i.lookup.dir = *dir;
+	}
+
+	if ((err = proc_send(dir->port, msg)) < 0)
+		return err;
 
-	if (prev != NULL)
-		prev->next = entry->next;
-	else
-		name_common.dcache[hash] = NULL;
-	proc_lockClear(&name_common.dcache_lock);
+	if (open) {
+		*fil = msg->o.openpath.fil;
+		*dev = msg->o.openpath.dev;
+		return msg->o.openpath.err;
+	}
 
-	vm_kfree(entry);
+	*fil = msg->o.lookup.fil;
+	*dev = msg->o.lookup.dev;
+	return msg->o.lookup.err;
 }
 
 
-int proc_portLookup(const char *name, oid_t *file, oid_t *dev)
+/* Resolves name, object found is opened by its server as well if opened is given and server supports it */
+static int name_resolve(const char *name, oid_t *file, oid_t *dev, int flags, int *opened, offs_t *size)
 {
-	int err;
+	int err = EOK, res = EOK, open = (opened != NULL);
+	unsigned int gen;
 	dcache_entry_t *entry;
-	msg_t *msg;
+	msg_t *msg = NULL;
 	size_t len, i;
-	oid_t srv;
+	oid_t srv, fil, dv;
 	char pstack[16], *pheap = NULL, *pptr;
 
 	if (name == NULL || (file == NULL && dev == NULL))
 		return -EINVAL;
 
+	if (opened != NULL)
+		*opened = 0;
+
 	if (name[0] == '/' && name[1] == 0) {
 		if (name_common.root_registered) {
 			if (file != NULL)
@@ -151,27 +453,26 @@ int proc_portLookup(const char *name, oid_t *file, oid_t *dev)
 		return -EINVAL;
 	}
 
+	len = hal_strlen(name);
+
 	/* Search cache for full path */
-	proc_lockSet(&name_common.dcache_lock);
-	if ((entry = _dcache_entryLookup(dcache_strHash(name), name)) != NULL) {
+	proc_rwLockRead(&name_common.dcache_lock);
+	if ((entry = _dcache_entryLookup(dcache_hash(NULL, name, len), NULL, name, len)) != NULL) {
 		if (file != NULL)
 			*file = entry->oid;
 		if (dev != NULL)
 			*dev = entry->oid;
-		proc_lockClear(&name_common.dcache_lock);
+		proc_rwLockClear(&name_common.dcache_lock);
 		return EOK;
 	}
-	proc_lockClear(&name_common.dcache_lock);
+	proc_rwLockClear(&name_common.dcache_lock);
 
 	if (name[0] != '/')
 		return -ENOENT;
 
 	srv = name_common.root_oid;
 
-#if 1 /* (MOD) */
 	/* Search cache for starting point */
-	len = hal_strlen(name);
-
 	if (len < sizeof(pstack)) {
 		pptr = pstack;
 	}
@@ -192,13 +493,13 @@ int proc_portLookup(const char *name, oid_t *file, oid_t *dev)
 
 		pptr[i] = '\0';
 
-		proc_lockSet(&name_common.dcache_lock);
-		if ((entry = _dcache_entryLookup(dcache_strHash(pptr), pptr)) != NULL) {
+		proc_rwLockRead(&name_common.dcache_lock);
+		if ((entry = _dcache_entryLookup(dcache_hash(NULL, pptr, i), NULL, pptr, i)) != NULL) {
 			srv = entry->oid;
-			proc_lockClear(&name_common.dcache_lock);
+			proc_rwLockClear(&name_common.dcache_lock);
 			break;
 		}
-		proc_lockClear(&name_common.dcache_lock);
+		proc_rwLockClear(&name_common.dcache_lock);
 	}
 
 	if (!name_common.root_registered && !i) {
@@ -207,50 +508,78 @@ int proc_portLookup(const char *name, oid_t *file, oid_t *dev)
 		return -EINVAL;
 	}
 
-	if ((msg = vm_kmalloc(sizeof(msg_t))) == NULL) {
-		if (pheap != NULL)
-			vm_kfree(pheap);
-		return -ENOMEM;
-	}
+	fil = srv;
+	dv = srv;
 
-	hal_memset(msg, 0, sizeof(msg_t));
-	msg->type = mtLookup;
-
-	/* Query servers */
-	do {
-		msg->i.lookup.dir = srv;
-		msg->i.size = len - i;
-		hal_memcpy(pptr, name + i + 1, len - i);
-		msg->i.data = pptr;
-
-		if ((err = proc_send(srv.port, msg)) < 0)
-			break;
-
-		srv = msg->o.lookup.dev;
-
-		if ((err = msg->o.lookup.err) < 0)
+	/* Query servers, results already known are taken from cache */
+	while (i != len) {
+		if ((err = dcache_resolve(&srv, name + i + 1, len - i - 1, &fil, &dv)) < 0)
 			break;
 
-		if (i + err > len) {
-			err = -EINVAL;
-			break;
+		if (err == 0) {
+			if (msg == NULL && (msg = vm_kmalloc(sizeof(msg_t))) == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+
+			hal_memcpy(pptr, name + i + 1, len - i);
+			gen = __atomic_load_n(&name_common.gen, __ATOMIC_ACQUIRE);
+			err = name_query(msg, &srv, pptr, len - i - 1, flags, open, &fil, &dv);
+
+			/* Servers not supporting combined request are asked for lookup only */
+			if (open && (err == -ENOSYS || err == -EINVAL || (err == 0 && !msg->o.openpath.opened))) {
+				open = 0;
+				continue;
+			}
+
+			if (err < 0) {
+				if (err == -ENOENT)
+					dcache_add(&srv, name + i + 1, len - i - 1, NULL, NULL, err, gen);
+				break;
+			}
+
+			if (i + err + 1 > len) {
+				err = -EINVAL;
+				break;
+			}
+
+			dcache_add(&srv, name + i + 1, err, &fil, &dv, 0, gen);
+
+			if (open && msg->o.openpath.opened && i + err + 1 == len) {
+				*opened = 1;
+				*size = msg->o.openpath.size;
+				res = msg->o.openpath.id;
+			}
 		}
 
+		srv = dv;
 		i += err + 1;
 	}
-	while (i != len);
 
-	if (file != NULL)
-		*file = msg->o.lookup.fil;
-	if (dev != NULL)
-		*dev = msg->o.lookup.dev;
+	if (err >= 0) {
+		if (file != NULL)
+			*file = fil;
+		if (dev != NULL)
+			*dev = dv;
+	}
 
-	vm_kfree(msg);
+	if (msg != NULL)
+		vm_kfree(msg);
 	if (pheap != NULL)
 		vm_kfree(pheap);
-	return err < 0 ? err : EOK;
-#endif
+	return err < 0 ? err : res;
+}
+
+
+int proc_portLookup(const char *name, oid_t *file, oid_t *dev)
+{
+	return name_resolve(name, file, dev, 0, NULL, NULL);
+}
+
 
+int proc_openPath(const char *name, int flags, oid_t *file, oid_t *dev, int *opened, offs_t *size)
+{
+	return name_resolve(name, file, dev, flags, opened, size);
 }
 
 
@@ -477,8 +806,14 @@ int proc_size(oid_t oid)
 
 void _name_init(void)
 {
-	proc_lockInit(&name_common.dcache_lock);
-
-	hal_memset(name_common.dcache, NULL, sizeof(name_common.dcache));
+	proc_rwLockInit(&name_common.dcache_lock);
+
+	hal_memset(name_common.initial, 0, sizeof(name_common.initial));
+	name_common.dcache = name_common.initial;
+	name_common.bits = HASH_LEN;
+	name_common.count = 0;
+	name_common.cached = 0;
+	name_common.gen = 0;
+	hal_memset(name_common.ports, 0, sizeof(name_common.ports));
 	name_common.root_registered = 0;
 }
@@ -67,6 +67,14 @@ extern int proc_portLookup(const char *name, oid_t *file, oid_t *dev);
 extern int proc_lookup(const char *name, oid_t *file, oid_t *dev);
 
 
+/* Drops lookup results cached from server port if its response to message of type may change namespace */
+extern void proc_dcacheUpdate(u32 port, int type);
+
+
+/* Looks name up and opens object found in one request, opened is cleared if its server needs separate open */
+extern int proc_openPath(const char *name, int flags, oid_t *file, oid_t *dev, int *opened, offs_t *size);
+
+
 extern int proc_read(oid_t oid, size_t offs, void *buf, size_t sz, unsigned mode);
 
 
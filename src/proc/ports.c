@@ -14,11 +14,22 @@
  */
 
 #include "ports.h"
+#include "rwlock.h"
+#include "ring.h"
+
+#define PORT_CHUNKSZ 256    /* Ports per handle table chunk */
+#define PORT_CHUNKS  256    /* Ports with higher ids are found in the tree only */
 
 
 struct {
 	rbtree_t tree;
-	lock_t port_lock;
+	rwlock_t port_lock;
+
+	/* Handle table indexed by port id, chunks are never freed */
+	port_t **table[PORT_CHUNKS];
+
+	/* Freed ports are recycled, so lockless lookup never touches released memory */
+	port_t *free;
 } port_common;
 
 
@@ -137,21 +148,78 @@ static int _proc_portAlloc(u32 *id)
 }
 
 
+/* Takes reference unless port is already being released */
+static int port_ref(port_t *p)
+{
+	int refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+
+	do {
+		if (refs == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&p->refs, &refs, refs + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+
+static port_t **port_slot(u32 id)
+{
+	port_t **chunk;
+
+	if (id >= PORT_CHUNKS * PORT_CHUNKSZ)
+		return NULL;
+
+	if ((chunk = __atomic_load_n(&port_common.table[id / PORT_CHUNKSZ], __ATOMIC_ACQUIRE)) == NULL)
+		return NULL;
+
+	return &chunk[id % PORT_CHUNKSZ];
+}
+
+
+/* Allocates handle table chunk for id, port_lock is held */
+static int _port_slotAlloc(u32 id)
+{
+	port_t **chunk;
+
+	if (id >= PORT_CHUNKS * PORT_CHUNKSZ || port_common.table[id / PORT_CHUNKSZ] != NULL)
+		return EOK;
+
+	if ((chunk = vm_kmalloc(PORT_CHUNKSZ * sizeof(port_t *))) == NULL)
+		return -ENOMEM;
+
+	hal_memset(chunk, 0, PORT_CHUNKSZ * sizeof(port_t *));
+	__atomic_store_n(&port_common.table[id / PORT_CHUNKSZ], chunk, __ATOMIC_RELEASE);
+
+	return EOK;
+}
+
+
 port_t *proc_portGet(u32 id)
 {
-	port_t *port;
+	port_t *port, **slot;
 	port_t t;
 
+	if ((slot = port_slot(id)) != NULL) {
+		/* Fast path, no global lock is taken */
+		if ((port = __atomic_load_n(slot, __ATOMIC_ACQUIRE)) == NULL || !port_ref(port))
+			return NULL;
+
+		/* Port might have been recycled meanwhile */
+		if (port->id != id) {
+			port_put(port, 0);
+			return NULL;
+		}
+
+		return port;
+	}
+
 	t.id = id;
 
-	proc_lockSet(&port_common.port_lock);
+	proc_rwLockRead(&port_common.port_lock);
 	port = lib_treeof(port_t, linkage, lib_rbFind(&port_common.tree, &t.linkage));
-	if (port != NULL) {
-		hal_spinlockSet(&port->spinlock);
-		port->refs++;
-		hal_spinlockClear(&port->spinlock);
-	}
-	proc_lockClear(&port_common.port_lock);
+	if (port != NULL && !port_ref(port))
+		port = NULL;
+	proc_rwLockClear(&port_common.port_lock);
 
 	return port;
 }
@@ -159,66 +227,133 @@ port_t *proc_portGet(u32 id)
 
 void port_put(port_t *p, int destroy)
 {
-	proc_lockSet(&port_common.port_lock);
-	hal_spinlockSet(&p->spinlock);
-	p->refs--;
+	port_t **slot;
 
-	if (destroy)
+	if (destroy) {
+		hal_spinlockSet(&p->spinlock);
 		p->closed = 1;
 
-	if (p->refs) {
-		if (destroy)
-			/* Wake receivers up */
-			proc_threadBroadcast(&p->threads);
-
+		/* Wake receivers up */
+		proc_threadBroadcast(&p->threads);
 		hal_spinlockClear(&p->spinlock);
-		proc_lockClear(&port_common.port_lock);
+	}
+
+	if (lib_atomicDecrement(&p->refs))
 		return;
+
+	proc_rwLockWrite(&port_common.port_lock);
+	lib_rbRemove(&port_common.tree, &p->linkage);
+	if ((slot = port_slot(p->id)) != NULL)
+		__atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+	proc_rwLockClear(&port_common.port_lock);
+
+	if (p->owner != NULL) {
+		proc_lockSet(&p->owner->lock);
+		if (p->next != NULL)
+			LIST_REMOVE(&p->owner->ports, p);
+		proc_lockClear(&p->owner->lock);
 	}
 
+	hal_spinlockSet(&p->spinlock);
+	_proc_msgDrain(p);
 	hal_spinlockClear(&p->spinlock);
-	lib_rbRemove(&port_common.tree, &p->linkage);
-	proc_lockClear(&port_common.port_lock);
 
-	proc_lockSet(&p->owner->lock);
-	if (p->next != NULL)
-		LIST_REMOVE(&p->owner->ports, p);
-	proc_lockClear(&p->owner->lock);
+	/* Port memory is reused only for ports, its locks stay initialized */
+	proc_rwLockWrite(&port_common.port_lock);
+	LIST_ADD(&port_common.free, p);
+	proc_rwLockClear(&port_common.port_lock);
+}
+
 
-	hal_spinlockDestroy(&p->spinlock);
-	vm_kfree(p);
+/* Removes member from set, setlock is held */
+static void port_setUnlink(port_t *set, port_t *m)
+{
+	LIST_REMOVE_EX(&set->members, m, setnext, setprev);
+
+	hal_spinlockSet(&m->spinlock);
+	m->set = NULL;
+	hal_spinlockClear(&m->spinlock);
+
+	port_put(m, 0);
+}
+
+
+/* Removes port from its set and releases its own members */
+static void port_setDetach(port_t *p)
+{
+	port_t *set, *m;
+
+	hal_spinlockSet(&p->spinlock);
+	if ((set = p->set) != NULL) {
+		lib_atomicIncrement(&set->refs);
+	}
+	hal_spinlockClear(&p->spinlock);
+
+	if (set != NULL) {
+		proc_lockSet(&set->setlock);
+		if (p->set == set)
+			port_setUnlink(set, p);
+		proc_lockClear(&set->setlock);
+		port_put(set, 0);
+	}
+
+	proc_lockSet(&p->setlock);
+	while ((m = p->members) != NULL)
+		port_setUnlink(p, m);
+	proc_lockClear(&p->setlock);
 }
 
 
 int proc_portCreate(u32 *id)
 {
-	port_t *port;
+	port_t *port, **slot;
 	thread_t *curr;
 	process_t *proc = NULL;
 
+	proc_rwLockWrite(&port_common.port_lock);
+	if ((port = port_common.free) != NULL)
+		LIST_REMOVE(&port_common.free, port);
+	proc_rwLockClear(&port_common.port_lock);
 
-	if ((port = vm_kmalloc(sizeof(port_t))) == NULL)
-		return -ENOMEM;
+	if (port == NULL) {
+		if ((port = vm_kmalloc(sizeof(port_t))) == NULL)
+			return -ENOMEM;
 
-	proc_lockSet(&port_common.port_lock);
-	if (_proc_portAlloc(&port->id) != EOK) {
-		proc_lockClear(&port_common.port_lock);
-		vm_kfree(port);
+		port->refs = 0;
+		hal_spinlockCreate(&port->spinlock, "port.spinlock");
+		proc_lockInit(&port->setlock);
+	}
+
+	proc_rwLockWrite(&port_common.port_lock);
+	if (_proc_portAlloc(&port->id) != EOK || _port_slotAlloc(port->id) != EOK) {
+		LIST_ADD(&port_common.free, port);
+		proc_rwLockClear(&port_common.port_lock);
 		return -EINVAL;
 	}
 
 	lib_rbInsert(&port_common.tree, &port->linkage);
+	proc_rwLockClear(&port_common.port_lock);
 
 	port->kmessages = NULL;
-	hal_spinlockCreate(&port->spinlock, "port.spinlock");
-
+	port->received = NULL;
 	port->threads = NULL;
 	port->current = NULL;
-	port->refs = 1;
+	port->rings = NULL;
+	port->ringid = 0;
+	port->ringsz = 0;
+	port->pulses = 0;
+
+	port->set = NULL;
+	port->members = NULL;
+	port->setnext = NULL;
+	port->setprev = NULL;
+	port->setgen = 0;
+	hal_memset(&port->stats, 0, sizeof(port->stats));
 	port->closed = 0;
+	port->next = NULL;
+	port->prev = NULL;
 
 	*id = port->id;
-	proc_lockClear(&port_common.port_lock);
 
 	if ((curr = proc_current()) != NULL && (proc = curr->process) != NULL) {
 		proc_lockSet(&proc->lock);
@@ -227,10 +362,12 @@ int proc_portCreate(u32 *id)
 	}
 
 	port->owner = proc;
+	port->pid = (proc != NULL) ? proc->id : 0;
 
-	proc_lockSet(&port_common.port_lock);
-	lib_rbInsert(&port_common.tree, &port->linkage);
-	proc_lockClear(&port_common.port_lock);
+	/* Publish port, stale lookups of recycled port see new id before it is referenced */
+	__atomic_store_n(&port->refs, 1, __ATOMIC_RELEASE);
+	if ((slot = port_slot(port->id)) != NULL)
+		__atomic_store_n(slot, port, __ATOMIC_RELEASE);
 
 	return EOK;
 }
@@ -257,6 +394,9 @@ void proc_portDestroy(u32 port)
 		}
 	}
 
+	proc_ringsDetach(p);
+	port_setDetach(p);
+
 	port_put(p, 0);
 	port_put(p, 1);
 }
@@ -269,14 +409,257 @@ void proc_portsDestroy(process_t *proc)
 	while (proc_lockSet(&proc->lock), (p = proc->ports) != NULL) {
 		LIST_REMOVE(&proc->ports, p);
 		proc_lockClear(&proc->lock);
+		proc_ringsDetach(p);
+		port_setDetach(p);
+#ifndef NOMMU
+		proc_msgReclaim(p);
+#endif
+
+		/* Port may outlive its owner while clients hold references */
+		hal_spinlockSet(&p->spinlock);
+		p->owner = NULL;
+		hal_spinlockClear(&p->spinlock);
+
 		port_put(p, 1);
 	}
 	proc_lockClear(&proc->lock);
 }
 
 
+int proc_portSetAdd(u32 set, u32 port)
+{
+	process_t *process = proc_current()->process;
+	port_t *s, *m;
+	int err = EOK;
+
+	if ((s = proc_portGet(set)) == NULL)
+		return -EINVAL;
+
+	if ((m = proc_portGet(port)) == NULL) {
+		port_put(s, 0);
+		return -EINVAL;
+	}
+
+	if (s == m || s->owner != process || m->owner != process) {
+		port_put(m, 0);
+		port_put(s, 0);
+		return -EINVAL;
+	}
+
+	proc_lockSet(&s->setlock);
+	hal_spinlockSet(&m->spinlock);
+	/* Sets are not nested */
+	if (m->set != NULL || m->members != NULL || s->set != NULL)
+		err = -EBUSY;
+	else
+		m->set = s;
+	hal_spinlockClear(&m->spinlock);
+
+	if (err == EOK)
+		LIST_ADD_EX(&s->members, m, setnext, setprev);
+	proc_lockClear(&s->setlock);
+
+	if (err == EOK) {
+		/* Member may already have messages pending */
+		hal_spinlockSet(&s->spinlock);
+		s->setgen++;
+		proc_threadBroadcast(&s->threads);
+		hal_spinlockClear(&s->spinlock);
+	}
+	else {
+		port_put(m, 0);
+	}
+
+	port_put(s, 0);
+	return err;
+}
+
+
+int proc_portSetRemove(u32 set, u32 port)
+{
+	port_t *s, *m;
+	int err = -EINVAL;
+
+	if ((s = proc_portGet(set)) == NULL)
+		return -EINVAL;
+
+	if ((m = proc_portGet(port)) == NULL) {
+		port_put(s, 0);
+		return -EINVAL;
+	}
+
+	proc_lockSet(&s->setlock);
+	if (m->set == s && s->owner == proc_current()->process) {
+		port_setUnlink(s, m);
+		err = EOK;
+	}
+	proc_lockClear(&s->setlock);
+
+	port_put(m, 0);
+	port_put(s, 0);
+	return err;
+}
+
+
+void _port_signal(port_t *p)
+{
+	p->setgen++;
+
+	if (p->set != NULL) {
+		hal_spinlockSet(&p->set->spinlock);
+		p->set->setgen++;
+		proc_threadWakeup(&p->set->threads);
+		hal_spinlockClear(&p->set->spinlock);
+	}
+}
+
+
+unsigned int port_setGen(port_t *set)
+{
+	unsigned int gen;
+
+	hal_spinlockSet(&set->spinlock);
+	gen = set->setgen;
+	hal_spinlockClear(&set->spinlock);
+
+	return gen;
+}
+
+
+static void port_setCandidate(port_t *p, port_t **best, unsigned int *priority)
+{
+	kmsg_t *kmsg;
+
+	hal_spinlockSet(&p->spinlock);
+	if ((kmsg = p->kmessages) != NULL) {
+#ifndef NOMMU
+		if (*best == NULL || kmsg->msg.priority < *priority) {
+			*best = p;
+			*priority = kmsg->msg.priority;
+		}
+#else
+		if (*best == NULL || kmsg->msg->priority < *priority) {
+			*best = p;
+			*priority = kmsg->msg->priority;
+		}
+#endif
+	}
+	hal_spinlockClear(&p->spinlock);
+}
+
+
+port_t *port_setSelect(port_t *set)
+{
+	port_t *m, *best = NULL;
+	unsigned int priority = 0;
+
+	proc_lockSet(&set->setlock);
+
+	port_setCandidate(set, &best, &priority);
+
+	if ((m = set->members) != NULL) {
+		do
+			port_setCandidate(m, &best, &priority);
+		while ((m = m->setnext) != set->members);
+	}
+
+	if (best != NULL) {
+		/* Round robin among members with messages of the same priority */
+		if (best != set)
+			set->members = best->setnext;
+
+		lib_atomicIncrement(&best->refs);
+	}
+
+	proc_lockClear(&set->setlock);
+
+	return best;
+}
+
+
+int port_setWait(port_t *set, unsigned int gen, time_t deadline)
+{
+	int err = EOK;
+
+	hal_spinlockSet(&set->spinlock);
+	while (set->setgen == gen && !set->closed && err == EOK)
+		err = proc_threadWaitUntil(&set->threads, &set->spinlock, deadline);
+
+	if (set->closed)
+		err = -EINVAL;
+	hal_spinlockClear(&set->spinlock);
+
+	return err;
+}
+
+
+static void port_latency(unsigned int *hist, time_t lat)
+{
+	unsigned int i;
+
+	for (i = 0; i < PORT_HISTSZ - 1 && (lat >> (i + 1)) != 0; i++)
+		;
+
+	hist[i]++;
+}
+
+
+time_t _port_statRecv(port_t *p, time_t sent)
+{
+	time_t now = proc_uptime();
+
+	p->stats.received++;
+
+	if (sent)
+		port_latency(p->stats.recvlat, now - sent);
+
+	return now;
+}
+
+
+void _port_statRespond(port_t *p, time_t received)
+{
+	p->stats.responded++;
+
+	if (received)
+		port_latency(p->stats.resplat, proc_uptime() - received);
+}
+
+
+int proc_portsList(int n, portinfo_t *info)
+{
+	int i = 0;
+	port_t *p;
+	portstats_t stats;
+
+	proc_rwLockRead(&port_common.port_lock);
+
+	p = lib_treeof(port_t, linkage, lib_rbMinimum(port_common.tree.root));
+
+	while (i < n && p != NULL) {
+		/* Snapshot is taken first, copying to user buffer may fault */
+		hal_spinlockSet(&p->spinlock);
+		hal_memcpy(&stats, &p->stats, sizeof(portstats_t));
+		hal_spinlockClear(&p->spinlock);
+
+		info[i].id = p->id;
+		info[i].pid = p->pid;
+		hal_memcpy(&info[i].stats, &stats, sizeof(portstats_t));
+
+		++i;
+		p = lib_treeof(port_t, linkage, lib_rbNext(&p->linkage));
+	}
+
+	proc_rwLockClear(&port_common.port_lock);
+
+	return i;
+}
+
+
 void _port_init(void)
 {
 	lib_rbInit(&port_common.tree, ports_cmp, ports_augment);
-	proc_lockInit(&port_common.port_lock);
+	proc_rwLockInit(&port_common.port_lock);
+	hal_memset(port_common.table, 0, sizeof(port_common.table));
+	port_common.free = NULL;
 }
@@ -20,6 +20,7 @@
 #include "msg.h"
 #include "process.h"
 #include "threads.h"
+#include "lock.h"
 
 
 typedef struct _port_t {
@@ -31,12 +32,34 @@ typedef struct _port_t {
 	u32 lmaxgap;
 	u32 rmaxgap;
 	kmsg_t *kmessages;
+
+	/* Messages being served, timed out senders leave them to the owner */
+	kmsg_t *received;
+
 	process_t *owner;
+	unsigned int pid;
 	int refs, closed;
 
 	spinlock_t spinlock;
 	thread_t *threads;
 	msg_t *current;
+
+	struct _ring_t *rings;
+	unsigned int ringid;
+	size_t ringsz;
+
+	/* Pending pulses, limited per port */
+	unsigned int pulses;
+
+	/* Port set membership, members are protected by setlock */
+	struct _port_t *set;
+	struct _port_t *members;
+	struct _port_t *setnext;
+	struct _port_t *setprev;
+	lock_t setlock;
+	unsigned int setgen;
+
+	portstats_t stats;
 } port_t;
 
 
@@ -55,6 +78,39 @@ extern port_t *proc_portGet(u32 id);
 extern void port_put(port_t *p, int destroy);
 
 
+/* Adds port to set, both have to be owned by caller */
+extern int proc_portSetAdd(u32 set, u32 port);
+
+
+extern int proc_portSetRemove(u32 set, u32 port);
+
+
+/* Signals new message to port set receivers, port spinlock is held */
+extern void _port_signal(port_t *p);
+
+
+extern unsigned int port_setGen(port_t *set);
+
+
+/* Returns referenced member with the most urgent pending message */
+extern port_t *port_setSelect(port_t *set);
+
+
+/* Waits until message is queued on set or any of its members after generation gen, or until deadline */
+extern int port_setWait(port_t *set, unsigned int gen, time_t deadline);
+
+
+/* Accounts received message sent at time sent (if known), returns receive time, port spinlock is held */
+extern time_t _port_statRecv(port_t *p, time_t sent);
+
+
+/* Accounts response to message received at time received, port spinlock is held */
+extern void _port_statRespond(port_t *p, time_t received);
+
+
+extern int proc_portsList(int n, portinfo_t *info);
+
+
 extern void _port_init(void);
 
 
@@ -25,7 +25,9 @@ int _proc_init(vm_map_t *kmap, vm_object_t *kernel)
 	_process_init(kmap, kernel);
 	_port_init();
 	_msg_init(kmap, kernel);
+	_ring_init(kmap);
 	_name_init();
+	_futex_init();
 	_userintr_init();
 
 	return EOK;
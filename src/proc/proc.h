@@ -21,6 +21,7 @@
 #include "threads.h"
 #include "process.h"
 #include "lock.h"
+#include "rwlock.h"
 #include "msg.h"
 #include "name.h"
 #include "resource.h"
@@ -29,6 +30,8 @@
 #include "file.h"
 #include "userintr.h"
 #include "ports.h"
+#include "futex.h"
+#include "ring.h"
 
 
 extern int _proc_init(vm_map_t *kmap, vm_object_t *kernel);
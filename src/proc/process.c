@@ -88,13 +88,18 @@ process_t *proc_find(unsigned pid)
 static void process_destroy(process_t *p)
 {
 	thread_t *ghost;
+	vm_map_t *map;
 
 	perf_kill(p);
 
 	posix_died(p->id, p->exit);
+	p->posix = NULL;
 
-	if (p->mapp != NULL)
-		vm_mapDestroy(p, p->mapp);
+	/* Address space is gone for resources and ports released below */
+	if ((map = p->mapp) != NULL) {
+		p->mapp = NULL;
+		vm_mapDestroy(p, map);
+	}
 
 	proc_resourcesDestroy(p);
 	proc_portsDestroy(p);
@@ -275,6 +280,7 @@ int proc_start(void (*initthr)(void *), void *arg, const char *path)
 	proc_lockInit(&process->lock);
 
 	process->ports = NULL;
+	process->posix = NULL;
 
 	process->sigpend = 0;
 	process->sigmask = 0;
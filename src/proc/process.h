@@ -58,6 +58,7 @@ typedef struct _process_t {
 	u32 umask;*/
 
 	void *ports;
+	void *posix;
 
 	rbtree_t resources;
 
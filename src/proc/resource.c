@@ -22,6 +22,7 @@
 #include "resource.h"
 #include "name.h"
 #include "userintr.h"
+#include "ring.h"
 
 
 static int resource_cmp(rbnode_t *n1, rbnode_t *n2)
@@ -211,6 +212,10 @@ int proc_resourcePut(resource_t *r)
 	case rtInth:
 		rem = userintr_put(resourceof(userintr_t, resource, r));
 		break;
+
+	case rtRing:
+		rem = ring_put(resourceof(ring_t, resource, r));
+		break;
 	}
 
 	return rem;
@@ -261,7 +266,8 @@ int proc_resourcesCopy(process_t *source)
 			break;
 
 		case rtInth:
-			/* Don't copy interrupt handlers */
+		case rtRing:
+			/* Don't copy interrupt handlers and rings */
 			err = EOK;
 			break;
 
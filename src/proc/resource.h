@@ -34,7 +34,7 @@ typedef struct {
 } fd_t;
 
 
-enum { rtLock = 0, rtCond, rtFile, rtInth };
+enum { rtLock = 0, rtCond, rtFile, rtInth, rtRing };
 
 
 typedef struct _resource_t {
@@ -44,8 +44,8 @@ typedef struct _resource_t {
 
 	unsigned lgap : 1;
 	unsigned rgap : 1;
-	unsigned type : 2;
-	unsigned id : 28;
+	unsigned type : 3;
+	unsigned id : 27;
 } resource_t;
 
 
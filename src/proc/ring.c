@@ -0,0 +1,447 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Shared memory submission/completion ring channels
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include HAL
+#include "../../include/errno.h"
+#include "../lib/lib.h"
+#include "proc.h"
+
+#define RING_MAXSZ  (256 * SIZE_PAGE)
+#define RING_PORTSZ RING_MAXSZ         /* Memory mapped into port owner by rings of all its clients */
+
+
+struct {
+	vm_map_t *kmap;
+} ring_common;
+
+
+/* Accounts ring memory mapped into port owner, server doesn't agree to rings so their total is limited */
+static int ring_reserve(port_t *p, size_t size)
+{
+	int err = EOK;
+
+	hal_spinlockSet(&p->spinlock);
+	if (p->closed)
+		err = -EINVAL;
+	else if (size > RING_PORTSZ - p->ringsz)
+		err = -ENOSPC;
+	else
+		p->ringsz += size;
+	hal_spinlockClear(&p->spinlock);
+
+	return err;
+}
+
+
+static void ring_unreserve(port_t *p, size_t size)
+{
+	hal_spinlockSet(&p->spinlock);
+	p->ringsz -= size;
+	hal_spinlockClear(&p->spinlock);
+}
+
+
+#ifndef NOMMU
+/* Returns referenced owner of port with address space, ports created by kernel have none */
+static int ring_owner(port_t *p, process_t **owner)
+{
+	process_t *proc;
+	int err = EOK;
+
+	*owner = NULL;
+
+	if (p->pid == 0)
+		return EOK;
+
+	proc = proc_find(p->pid);
+
+	hal_spinlockSet(&p->spinlock);
+	if (p->closed || proc == NULL || p->owner != proc || proc->mapp == NULL)
+		err = -EINVAL;
+	hal_spinlockClear(&p->spinlock);
+
+	if (err < 0) {
+		if (proc != NULL)
+			proc_put(proc);
+		return err;
+	}
+
+	*owner = proc;
+
+	return EOK;
+}
+#endif
+
+
+static void ring_drop(ring_t *r)
+{
+	if (lib_atomicDecrement(&r->refs))
+		return;
+
+	ring_unreserve(r->port, r->size);
+
+#ifndef NOMMU
+	vm_munmap(ring_common.kmap, r->ring, r->size);
+	vm_pageFree(r->pages);
+#else
+	vm_kfree(r->ring);
+#endif
+
+	port_put(r->port, 0);
+	hal_spinlockDestroy(&r->spinlock);
+	vm_kfree(r);
+}
+
+
+static msg_t *ring_msg(ring_t *r)
+{
+#ifndef NOMMU
+	return &r->doorbell.msg;
+#else
+	return r->doorbell.msg;
+#endif
+}
+
+
+static void _ring_unlink(ring_t *r)
+{
+	LIST_REMOVE(&r->port->rings, r);
+	_proc_msgCancel(r->port, &r->doorbell);
+}
+
+
+/* Releases server side of unlinked ring, its view is unmapped if address space still exists */
+static void ring_release(ring_t *r)
+{
+#ifndef NOMMU
+	process_t *owner = r->port->owner;
+
+	if (owner != NULL && owner->mapp != NULL)
+		vm_munmap(owner->mapp, r->svaddr, r->size);
+#endif
+
+	/* Wake clients waiting for completions */
+	hal_spinlockSet(&r->spinlock);
+	r->closed = 1;
+	proc_threadBroadcast(&r->threads);
+	hal_spinlockClear(&r->spinlock);
+
+	ring_drop(r);
+}
+
+
+static int ring_notify(ring_t *r, int closed)
+{
+	int err = -EPIPE;
+
+	hal_spinlockSet(&r->port->spinlock);
+	if (r->next != NULL) {
+		ring_msg(r)->i.ring.closed = closed;
+		err = _proc_msgNotify(r->port, &r->doorbell);
+	}
+	hal_spinlockClear(&r->port->spinlock);
+
+	return err;
+}
+
+
+int ring_put(ring_t *r)
+{
+	int rem;
+
+	if ((rem = resource_put(&r->resource)))
+		return rem;
+
+#ifndef NOMMU
+	if (r->client->mapp != NULL)
+		vm_munmap(r->client->mapp, r->cvaddr, r->size);
+#endif
+
+	/* Let server release its side */
+	ring_notify(r, 1);
+	ring_drop(r);
+
+	return rem;
+}
+
+
+static ring_t *ring_get(process_t *process, unsigned int h)
+{
+	resource_t *r;
+
+	if ((r = resource_get(process, rtRing, h)) == NULL)
+		return NULL;
+
+	if (r->type != rtRing)
+		return NULL;
+
+	return resourceof(ring_t, resource, r);
+}
+
+
+int proc_ringSetup(u32 port, unsigned int entries, size_t size, void **vaddr)
+{
+	process_t *process = proc_current()->process;
+#ifndef NOMMU
+	process_t *owner;
+#endif
+	port_t *p;
+	ring_t *r;
+	size_t offs;
+	int h, err;
+
+	if (process == NULL || entries == 0 || (entries & (entries - 1)))
+		return -EINVAL;
+
+	offs = (sizeof(msgring_t) + 7) & ~7;
+
+	if (entries > (RING_MAXSZ - offs) / (2 * sizeof(msgringent_t)))
+		return -EINVAL;
+
+	if (size > RING_MAXSZ)
+		return -EINVAL;
+
+	size = max(size, offs + 2 * entries * sizeof(msgringent_t));
+	size = (size + SIZE_PAGE - 1) & ~(SIZE_PAGE - 1);
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	if ((r = vm_kmalloc(sizeof(ring_t))) == NULL) {
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+
+#ifndef NOMMU
+	/* Owner stays referenced while its view is mapped */
+	if ((err = ring_owner(p, &owner)) < 0) {
+		vm_kfree(r);
+		port_put(p, 0);
+		return err;
+	}
+
+	if ((r->pages = vm_pageAlloc(size, PAGE_OWNER_APP)) == NULL) {
+		if (owner != NULL)
+			proc_put(owner);
+		vm_kfree(r);
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+
+	size = 1 << r->pages->idx;
+
+	if ((err = ring_reserve(p, size)) < 0) {
+		if (owner != NULL)
+			proc_put(owner);
+		vm_pageFree(r->pages);
+		vm_kfree(r);
+		port_put(p, 0);
+		return err;
+	}
+
+	r->ring = vm_mmap(ring_common.kmap, NULL, r->pages, size, PROT_READ | PROT_WRITE, NULL, -1, MAP_NONE);
+	r->cvaddr = vm_mmap(process->mapp, NULL, r->pages, size, PROT_READ | PROT_WRITE | PROT_USER, NULL, -1, MAP_NOINHERIT);
+
+	if (owner == NULL)
+		r->svaddr = r->ring;
+	else
+		r->svaddr = vm_mmap(owner->mapp, NULL, r->pages, size, PROT_READ | PROT_WRITE | PROT_USER, NULL, -1, MAP_NOINHERIT);
+
+	if (r->ring == NULL || r->cvaddr == NULL || r->svaddr == NULL) {
+		if (r->svaddr != NULL && r->svaddr != r->ring)
+			vm_munmap(owner->mapp, r->svaddr, size);
+
+		if (r->cvaddr != NULL)
+			vm_munmap(process->mapp, r->cvaddr, size);
+
+		if (r->ring != NULL)
+			vm_munmap(ring_common.kmap, r->ring, size);
+
+		if (owner != NULL)
+			proc_put(owner);
+
+		ring_unreserve(p, size);
+		vm_pageFree(r->pages);
+		vm_kfree(r);
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+#else
+	if ((err = ring_reserve(p, size)) < 0) {
+		vm_kfree(r);
+		port_put(p, 0);
+		return err;
+	}
+
+	if ((r->ring = vm_kmalloc(size)) == NULL) {
+		ring_unreserve(p, size);
+		vm_kfree(r);
+		port_put(p, 0);
+		return -ENOMEM;
+	}
+
+	r->cvaddr = r->ring;
+	r->svaddr = r->ring;
+#endif
+
+	hal_memset(r->ring, 0, sizeof(msgring_t));
+	r->ring->entries = entries;
+	r->ring->sqoffs = offs;
+	r->ring->cqoffs = offs + entries * sizeof(msgringent_t);
+	r->ring->dataoffs = offs + 2 * entries * sizeof(msgringent_t);
+
+	r->port = p;
+	r->client = process;
+	r->closed = 0;
+	r->refs = 2;
+	r->size = size;
+	r->threads = NULL;
+	hal_spinlockCreate(&r->spinlock, "ring.spinlock");
+
+	hal_memset(&r->doorbell, 0, sizeof(kmsg_t));
+#ifdef NOMMU
+	r->doorbell.msg = &r->msg;
+#endif
+	hal_memset(ring_msg(r), 0, sizeof(msg_t));
+	ring_msg(r)->type = mtRing;
+	ring_msg(r)->i.data = r->svaddr;
+	ring_msg(r)->i.size = size;
+
+	/* Rings of port being closed were already detached */
+	hal_spinlockSet(&p->spinlock);
+	if (!(err = p->closed ? -EINVAL : EOK)) {
+		r->id = p->ringid++;
+		ring_msg(r)->i.ring.id = r->id;
+		LIST_ADD(&p->rings, r);
+	}
+	hal_spinlockClear(&p->spinlock);
+
+	if (err < 0) {
+#ifndef NOMMU
+		vm_munmap(process->mapp, r->cvaddr, size);
+#endif
+		ring_release(r);
+		ring_drop(r);
+	}
+
+#ifndef NOMMU
+	if (owner != NULL)
+		proc_put(owner);
+#endif
+
+	if (err < 0)
+		return err;
+
+	h = resource_alloc(process, &r->resource, rtRing);
+	ring_put(r);
+
+	*vaddr = r->cvaddr;
+
+	return h;
+}
+
+
+int proc_ringEnter(unsigned int h, int wait, time_t timeout)
+{
+	ring_t *r;
+	int err = EOK;
+
+	if ((r = ring_get(proc_current()->process, h)) == NULL)
+		return -EINVAL;
+
+	/* Port is used as doorbell, pending notification is not queued twice */
+	if (r->ring->sqhead != r->ring->sqtail)
+		err = ring_notify(r, 0);
+
+	if (wait) {
+		hal_spinlockSet(&r->spinlock);
+		while (err == EOK && r->ring->cqhead == r->ring->cqtail) {
+			if (r->closed)
+				err = -EPIPE;
+			else
+				err = proc_threadWaitInterruptible(&r->threads, &r->spinlock, timeout);
+		}
+		hal_spinlockClear(&r->spinlock);
+	}
+
+	ring_put(r);
+	return err;
+}
+
+
+int proc_ringComplete(u32 port, unsigned int id)
+{
+	process_t *process = proc_current()->process;
+	port_t *p;
+	ring_t *r;
+	int closed = 0;
+
+	if ((p = proc_portGet(port)) == NULL)
+		return -EINVAL;
+
+	if (p->owner != process) {
+		port_put(p, 0);
+		return -EPERM;
+	}
+
+	hal_spinlockSet(&p->spinlock);
+	if ((r = p->rings) != NULL) {
+		while (r->id != id && (r = r->next) != p->rings)
+			;
+
+		if (r->id != id)
+			r = NULL;
+	}
+
+	if (r != NULL && (closed = ring_msg(r)->i.ring.closed)) {
+		_ring_unlink(r);
+	}
+	else if (r != NULL) {
+		hal_spinlockSet(&r->spinlock);
+		proc_threadBroadcast(&r->threads);
+		hal_spinlockClear(&r->spinlock);
+	}
+	hal_spinlockClear(&p->spinlock);
+
+	/* Client is gone, server releases its view */
+	if (closed)
+		ring_release(r);
+
+	port_put(p, 0);
+
+	return r == NULL ? -EINVAL : EOK;
+}
+
+
+void proc_ringsDetach(port_t *p)
+{
+	ring_t *r;
+
+	hal_spinlockSet(&p->spinlock);
+	while ((r = p->rings) != NULL) {
+		_ring_unlink(r);
+		hal_spinlockClear(&p->spinlock);
+
+		ring_release(r);
+
+		hal_spinlockSet(&p->spinlock);
+	}
+	hal_spinlockClear(&p->spinlock);
+}
+
+
+void _ring_init(vm_map_t *kmap)
+{
+	ring_common.kmap = kmap;
+}
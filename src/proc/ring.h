@@ -0,0 +1,72 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Shared memory submission/completion ring channels
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _PROC_RING_H_
+#define _PROC_RING_H_
+
+#include HAL
+#include "resource.h"
+#include "ports.h"
+
+
+typedef struct _ring_t {
+	resource_t resource;
+	struct _ring_t *next;
+	struct _ring_t *prev;
+
+	port_t *port;
+	process_t *client;
+	unsigned int id;
+	int closed;
+
+	/* Client and server side */
+	unsigned int refs;
+
+	page_t *pages;
+	size_t size;
+	msgring_t *ring;
+	void *cvaddr;
+	void *svaddr;
+
+	spinlock_t spinlock;
+	thread_t *threads;
+	kmsg_t doorbell;
+#ifdef NOMMU
+	msg_t msg;
+#endif
+} ring_t;
+
+
+extern int ring_put(ring_t *r);
+
+
+/* Creates ring mapped into caller and owner of port, returns ring handle, total size of port rings is limited */
+extern int proc_ringSetup(u32 port, unsigned int entries, size_t size, void **vaddr);
+
+
+/* Notifies server about submissions, waits for completions if requested */
+extern int proc_ringEnter(unsigned int h, int wait, time_t timeout);
+
+
+/* Called by server to wake client up or to release ring closed by client */
+extern int proc_ringComplete(u32 port, unsigned int id);
+
+
+extern void proc_ringsDetach(port_t *p);
+
+
+extern void _ring_init(vm_map_t *kmap);
+
+
+#endif
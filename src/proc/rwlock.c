@@ -0,0 +1,119 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Reader-writer locks
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include HAL
+#include "../../include/errno.h"
+#include "rwlock.h"
+#include "threads.h"
+
+
+int proc_rwLockRead(rwlock_t *rwlock)
+{
+	if (!hal_started())
+		return -EINVAL;
+
+	hal_spinlockSet(&rwlock->spinlock);
+
+	/* Don't starve waiting writers */
+	while (rwlock->writer || rwlock->writers)
+		proc_threadWait(&rwlock->rqueue, &rwlock->spinlock, 0);
+
+	rwlock->readers++;
+	hal_spinlockClear(&rwlock->spinlock);
+
+	return EOK;
+}
+
+
+int proc_rwLockWrite(rwlock_t *rwlock)
+{
+	if (!hal_started())
+		return -EINVAL;
+
+	hal_spinlockSet(&rwlock->spinlock);
+	rwlock->writers++;
+
+	while (rwlock->writer || rwlock->readers)
+		proc_threadWait(&rwlock->wqueue, &rwlock->spinlock, 0);
+
+	rwlock->writers--;
+	rwlock->writer = 1;
+	hal_spinlockClear(&rwlock->spinlock);
+
+	return EOK;
+}
+
+
+int proc_rwLockTryWrite(rwlock_t *rwlock)
+{
+	int err = EOK;
+
+	if (!hal_started())
+		return -EINVAL;
+
+	hal_spinlockSet(&rwlock->spinlock);
+	if (rwlock->writer || rwlock->readers)
+		err = -EBUSY;
+	else
+		rwlock->writer = 1;
+	hal_spinlockClear(&rwlock->spinlock);
+
+	return err;
+}
+
+
+int proc_rwLockClear(rwlock_t *rwlock)
+{
+	if (!hal_started())
+		return -EINVAL;
+
+	hal_spinlockSet(&rwlock->spinlock);
+
+	if (rwlock->writer)
+		rwlock->writer = 0;
+	else if (rwlock->readers)
+		rwlock->readers--;
+
+	if (!rwlock->readers) {
+		if (rwlock->writers)
+			proc_threadWakeup(&rwlock->wqueue);
+		else
+			proc_threadBroadcast(&rwlock->rqueue);
+	}
+
+	hal_spinlockClear(&rwlock->spinlock);
+
+	return EOK;
+}
+
+
+int proc_rwLockInit(rwlock_t *rwlock)
+{
+	rwlock->readers = 0;
+	rwlock->writers = 0;
+	rwlock->writer = 0;
+	rwlock->rqueue = NULL;
+	rwlock->wqueue = NULL;
+	hal_spinlockCreate(&rwlock->spinlock, "rwlock.spinlock");
+
+	return EOK;
+}
+
+
+int proc_rwLockDone(rwlock_t *rwlock)
+{
+	hal_spinlockDestroy(&rwlock->spinlock);
+
+	return EOK;
+}
@@ -0,0 +1,51 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Operating system kernel
+ *
+ * Reader-writer lock definition
+ *
+ * Copyright 2018 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _PROC_RWLOCK_H_
+#define _PROC_RWLOCK_H_
+
+#include HAL
+
+
+typedef struct _rwlock_t {
+	spinlock_t spinlock;
+	volatile unsigned int readers;
+	volatile unsigned int writers; /* Writers waiting for the lock, they take precedence over readers */
+	volatile char writer;
+
+	struct _thread_t *rqueue;
+	struct _thread_t *wqueue;
+} rwlock_t;
+
+
+extern int proc_rwLockRead(rwlock_t *rwlock);
+
+
+extern int proc_rwLockWrite(rwlock_t *rwlock);
+
+
+extern int proc_rwLockTryWrite(rwlock_t *rwlock);
+
+
+/* Releases shared or exclusive ownership, whichever is held */
+extern int proc_rwLockClear(rwlock_t *rwlock);
+
+
+extern int proc_rwLockInit(rwlock_t *rwlock);
+
+
+extern int proc_rwLockDone(rwlock_t *rwlock);
+
+
+#endif
@@ -23,14 +23,23 @@
 #include "resource.h"
 #include "msg.h"
 #include "ports.h"
+#include "rwlock.h"
+
+
+/* Deadline class bandwidth is limited to leave CPU time for fixed priority threads */
+#define DL_UTIL_SHIFT 16
+#define DL_UTIL_MAX   ((95 << DL_UTIL_SHIFT) / 100)
+#define DL_PERIOD_MAX 10000000
+
+#define LOCK_SPIN_MAX     2048 /* Lock state checks before waiting thread is put to sleep */
+#define LOCK_BACKOFF_MAX  64
 
 
 struct {
 	vm_map_t *kmap;
 	spinlock_t spinlock;
-	lock_t lock;
+	rwlock_t lock;
 	thread_t *ready[8];
-	thread_t **current;
 	volatile time_t jiffies;
 	time_t utcoffs;
 
@@ -38,6 +47,9 @@ struct {
 
 	/* Synchronized by spinlock */
 	rbtree_t sleeping;
+	rbtree_t dlready;
+	thread_t *dlthrottled;
+	unsigned int dlutil;
 
 	/* Synchronized by mutex */
 	unsigned int idcounter;
@@ -57,6 +69,9 @@ struct {
 	thread_t *volatile ghosts;
 	thread_t *reaper;
 
+	/* Number of lock waiters looking at lock owner, thread isn't destroyed until it drops to 0 */
+	unsigned int spinners;
+
 	int perfGather;
 	time_t perfLastTimestamp;
 	cbuffer_t perfBuffer;
@@ -67,6 +82,8 @@ struct {
 static thread_t *_proc_current(void);
 static void _proc_threadDequeue(thread_t *t);
 static int _proc_threadWait(thread_t **queue, time_t timeout);
+static void _threads_locksDetach(thread_t *t);
+static void _threads_readyAdd(thread_t *t, int waking);
 
 
 static int threads_sleepcmp(rbnode_t *n1, rbnode_t *n2)
@@ -90,6 +107,27 @@ static int threads_sleepcmp(rbnode_t *n1, rbnode_t *n2)
 }
 
 
+static int threads_dlcmp(rbnode_t *n1, rbnode_t *n2)
+{
+	thread_t *t1 = lib_treeof(thread_t, dl.linkage, n1);
+	thread_t *t2 = lib_treeof(thread_t, dl.linkage, n2);
+
+	if (t1->dl.absdeadline > t2->dl.absdeadline)
+		return 1;
+
+	else if (t1->dl.absdeadline < t2->dl.absdeadline)
+		return -1;
+
+	else if (t1->id < t2->id)
+		return -1;
+
+	else if (t1->id > t2->id)
+		return 1;
+
+	return 0;
+}
+
+
 static int threads_idcmp(rbnode_t *n1, rbnode_t *n2)
 {
 	thread_t *t1 = lib_treeof(thread_t, idlinkage, n1);
@@ -195,6 +233,27 @@ static void _perf_begin(thread_t *t)
 }
 
 
+static void _perf_priority(thread_t *t)
+{
+	perf_levent_priority_t ev;
+	time_t now;
+
+	if (!threads_common.perfGather)
+		return;
+
+	ev.sbz = 0;
+	ev.type = perf_levPriority;
+	ev.prio = t->priority;
+	ev.tid = perf_idpack(t->id);
+
+	now = TIMER_CYC2US(_threads_getTimer());
+	ev.deltaTimestamp = now - threads_common.perfLastTimestamp;
+	threads_common.perfLastTimestamp = now;
+
+	_cbuffer_write(&threads_common.perfBuffer, &ev, sizeof(ev));
+}
+
+
 void perf_end(thread_t *t)
 {
 	perf_levent_end_t ev;
@@ -428,12 +487,127 @@ static inline time_t _threads_getTimer(void)
 {
 #ifdef HPTIMER_IRQ
 	return hal_getTimer();
+#elif defined(TIMER_INTERPOLATION)
+	return threads_common.jiffies + hal_getTickOffset();
 #else
 	return threads_common.jiffies;
 #endif
 }
 
 
+/*
+ * Deadline scheduling class (constant bandwidth server)
+ */
+
+
+static void _threads_dlRelease(thread_t *t, time_t now)
+{
+	t->dl.release = now;
+	t->dl.absdeadline = now + t->dl.deadline;
+	t->dl.budget = t->dl.runtime;
+}
+
+
+static void _threads_dlCharge(thread_t *t, time_t now)
+{
+	time_t used = now - t->dl.dispatched;
+
+	t->dl.dispatched = now;
+	t->dl.budget = (used < t->dl.budget) ? t->dl.budget - used : 0;
+}
+
+
+static void _threads_dlAdd(thread_t *t, int waking)
+{
+	time_t now = _threads_getTimer();
+
+	/* CBS wakeup rule - open new reservation if remaining budget would exceed reserved bandwidth */
+	if (waking && (now >= t->dl.absdeadline || t->dl.budget * t->dl.period > (t->dl.absdeadline - now) * t->dl.runtime))
+		_threads_dlRelease(t, now);
+
+	/* Throttle until next period if budget is exhausted */
+	if (!t->dl.budget)
+		LIST_ADD(&threads_common.dlthrottled, t);
+	else
+		lib_rbInsert(&threads_common.dlready, &t->dl.linkage);
+}
+
+
+static void _threads_dlReplenish(time_t now)
+{
+	thread_t *t;
+	time_t release;
+
+	for (t = threads_common.dlthrottled; t != NULL;) {
+		if ((release = t->dl.release + t->dl.period) <= now) {
+			/* Don't let reservation fall behind after long delay */
+			if (release + t->dl.period <= now)
+				release = now;
+
+			LIST_REMOVE(&threads_common.dlthrottled, t);
+			_threads_dlRelease(t, release);
+			lib_rbInsert(&threads_common.dlready, &t->dl.linkage);
+
+			t = threads_common.dlthrottled;
+			continue;
+		}
+
+		if ((t = t->next) == threads_common.dlthrottled)
+			break;
+	}
+}
+
+
+static void _threads_dlDone(thread_t *t)
+{
+	threads_common.dlutil -= t->dl.util;
+	t->dl.util = 0;
+	t->dl.runtime = 0;
+}
+
+
+int proc_threadDeadline(time_t runtime, time_t deadline, time_t period)
+{
+	thread_t *current;
+	unsigned int util = 0;
+
+	if (runtime != 0) {
+		if (deadline == 0)
+			deadline = period;
+
+		if (runtime > deadline || deadline > period || period > DL_PERIOD_MAX)
+			return -EINVAL;
+
+		/* Density runtime / min(deadline, period) keeps EDF test sufficient for constrained deadlines */
+		if ((util = (unsigned int)((runtime << DL_UTIL_SHIFT) / deadline)) == 0)
+			util = 1;
+	}
+
+	hal_spinlockSet(&threads_common.spinlock);
+	current = _proc_current();
+
+	/* Admission control */
+	if (threads_common.dlutil - current->dl.util + util > DL_UTIL_MAX) {
+		hal_spinlockClear(&threads_common.spinlock);
+		return -EBUSY;
+	}
+
+	threads_common.dlutil += util - current->dl.util;
+	current->dl.util = util;
+	current->dl.runtime = TIMER_US2CYC(runtime);
+	current->dl.deadline = TIMER_US2CYC(deadline);
+	current->dl.period = TIMER_US2CYC(period);
+
+	if (runtime != 0) {
+		_threads_dlRelease(current, _threads_getTimer());
+		current->dl.dispatched = current->dl.release;
+	}
+	hal_spinlockClear(&threads_common.spinlock);
+
+	return EOK;
+}
+
+
 int threads_timeintr(unsigned int n, cpu_context_t *context, void *arg)
 {
 	thread_t *t;
@@ -458,6 +632,7 @@ int threads_timeintr(unsigned int n, cpu_context_t *context, void *arg)
 		hal_cpuSetReturnValue(t->context, -ETIME);
 	}
 
+	_threads_dlReplenish(now);
 	_threads_updateWakeup(now, t);
 
 	hal_spinlockClear(&threads_common.spinlock);
@@ -476,6 +651,10 @@ static void thread_destroy(thread_t *t)
 	process_t *process;
 	perf_end(t);
 
+	/* Lock owner which has exited may still be looked at by spinning waiter */
+	while (__atomic_load_n(&threads_common.spinners, __ATOMIC_SEQ_CST) != 0)
+		;
+
 	vm_kfree(t->kstack);
 
 	if ((process = t->process) != NULL) {
@@ -498,10 +677,13 @@ thread_t *threads_findThread(int tid)
 	thread_t *r, t;
 	t.id = tid;
 
-	proc_lockSet(&threads_common.lock);
-	if ((r = lib_treeof(thread_t, idlinkage, lib_rbFind(&threads_common.id, &t.idlinkage))) != NULL)
+	proc_rwLockRead(&threads_common.lock);
+	if ((r = lib_treeof(thread_t, idlinkage, lib_rbFind(&threads_common.id, &t.idlinkage))) != NULL) {
+		hal_spinlockSet(&threads_common.spinlock);
 		r->refs++;
-	proc_lockClear(&threads_common.lock);
+		hal_spinlockClear(&threads_common.spinlock);
+	}
+	proc_rwLockClear(&threads_common.lock);
 
 	return r;
 }
@@ -511,10 +693,10 @@ void threads_put(thread_t *t)
 {
 	int remaining;
 
-	proc_lockSet(&threads_common.lock);
+	proc_rwLockWrite(&threads_common.lock);
 	if (!(remaining = --t->refs))
 		lib_rbRemove(&threads_common.id, &t->idlinkage);
-	proc_lockClear(&threads_common.lock);
+	proc_rwLockClear(&threads_common.lock);
 
 	if (!remaining)
 		thread_destroy(t);
@@ -623,6 +805,50 @@ int threads_getCpuTime(thread_t *t)
 #endif
 
 
+static void _threads_readyAdd(thread_t *t, int waking)
+{
+	if (t->dl.runtime)
+		_threads_dlAdd(t, waking);
+	else
+		LIST_ADD(&threads_common.ready[t->priority], t);
+}
+
+
+static void _threads_ghostAdd(thread_t *t)
+{
+	_threads_locksDetach(t);
+	hal_spinlockDestroy(&t->locksSpinlock);
+	_threads_dlDone(t);
+	LIST_ADD(&threads_common.ghosts, t);
+	_proc_threadWakeup(&threads_common.reaper);
+}
+
+
+/* Returns thread woken up by current one if it is the best choice anyway */
+static thread_t *_threads_handoff(thread_t *current)
+{
+	thread_t *t;
+	unsigned int i;
+
+	if (current == NULL || (t = current->handoff) == NULL)
+		return NULL;
+
+	current->handoff = NULL;
+
+	if (t->state != READY || t->running || t->exit || t->dl.runtime || threads_common.dlready.root != NULL)
+		return NULL;
+
+	for (i = 0; i < t->priority; i++) {
+		if (threads_common.ready[i] != NULL)
+			return NULL;
+	}
+
+	LIST_REMOVE(&threads_common.ready[t->priority], t);
+
+	return t;
+}
+
+
 int threads_schedule(unsigned int n, cpu_context_t *context, void *arg)
 {
 	thread_t *current, *selected;
@@ -632,22 +858,42 @@ int threads_schedule(unsigned int n, cpu_context_t *context, void *arg)
 	threads_common.executions++;
 
 	hal_spinlockSet(&threads_common.spinlock);
-	current = threads_common.current[hal_cpuGetID()];
-	threads_common.current[hal_cpuGetID()] = NULL;
+	current = _proc_current();
+	hal_cpuSetCurrent(NULL);
 
 	/* Save current thread context */
 	if (current != NULL) {
 		current->context = context;
+		current->running = 0;
+
+		if (current->dl.runtime)
+			_threads_dlCharge(current, _threads_getTimer());
 
 		/* Move thread to the end of queue */
 		if (current->state == READY) {
-			LIST_ADD(&threads_common.ready[current->priority], current);
+			_threads_readyAdd(current, 0);
 			_perf_preempted(current);
 		}
 	}
 
+	/* Direct switch from IPC peer skips the ready queue search */
+	selected = _threads_handoff(current);
+
+	/* Deadline threads take precedence, earliest deadline first */
+	while (selected == NULL && (selected = lib_treeof(thread_t, dl.linkage, lib_rbMinimum(threads_common.dlready.root))) != NULL) {
+		lib_rbRemove(&threads_common.dlready, &selected->dl.linkage);
+
+		if (!selected->exit || hal_cpuSupervisorMode(selected->context)) {
+			selected->dl.dispatched = _threads_getTimer();
+			break;
+		}
+
+		_threads_ghostAdd(selected);
+		selected = NULL;
+	}
+
 	/* Get next thread */
-	for (i = 0; i < sizeof(threads_common.ready) / sizeof(thread_t *);) {
+	for (i = 0; selected == NULL && i < sizeof(threads_common.ready) / sizeof(thread_t *);) {
 		if ((selected = threads_common.ready[i]) == NULL) {
 			i++;
 			continue;
@@ -658,12 +904,13 @@ int threads_schedule(unsigned int n, cpu_context_t *context, void *arg)
 		if (!selected->exit || hal_cpuSupervisorMode(selected->context))
 			break;
 
-		LIST_ADD(&threads_common.ghosts, selected);
-		_proc_threadWakeup(&threads_common.reaper);
+		_threads_ghostAdd(selected);
+		selected = NULL;
 	}
 
 	if (selected != NULL) {
-		threads_common.current[hal_cpuGetID()] = selected;
+		hal_cpuSetCurrent(selected);
+		selected->running = 1;
 
 		if (((proc = selected->process) != NULL) && (proc->mapp != NULL)) {
 			/* Switch address space */
@@ -706,23 +953,14 @@ int threads_schedule(unsigned int n, cpu_context_t *context, void *arg)
 
 static thread_t *_proc_current(void)
 {
-	thread_t *current;
-
-	current = threads_common.current[hal_cpuGetID()];
-
-	return current;
+	return hal_cpuGetCurrent();
 }
 
 
 thread_t *proc_current(void)
 {
-	thread_t *current;
-
-	hal_spinlockSet(&threads_common.spinlock);
-	current = threads_common.current[hal_cpuGetID()];
-	hal_spinlockClear(&threads_common.spinlock);
-
-	return current;
+	/* Current thread is changed only by scheduler running on this CPU */
+	return hal_cpuGetCurrent();
 }
 
 
@@ -768,7 +1006,7 @@ static unsigned _thread_alloc(unsigned id)
 
 static unsigned thread_alloc(thread_t *thread)
 {
-	proc_lockSet(&threads_common.lock);
+	proc_rwLockWrite(&threads_common.lock);
 	thread->id = _thread_alloc(threads_common.idcounter);
 
 	if (!thread->id)
@@ -781,7 +1019,7 @@ static unsigned thread_alloc(thread_t *thread)
 		lib_rbInsert(&threads_common.id, &thread->idlinkage);
 		threads_common.idcounter++;
 	}
-	proc_lockClear(&threads_common.lock);
+	proc_rwLockClear(&threads_common.lock);
 
 	return thread->id;
 }
@@ -862,6 +1100,14 @@ int proc_threadCreate(process_t *process, void (*start)(void *), unsigned int *i
 	t->exit = 0;
 	t->execdata = NULL;
 	t->wait = NULL;
+	t->locks = NULL;
+	t->waitlock = NULL;
+	t->relock = NULL;
+	hal_spinlockCreate(&t->locksSpinlock, "thread.locksSpinlock");
+	t->running = 0;
+	t->handoff = NULL;
+	t->dl.runtime = 0;
+	t->dl.util = 0;
 
 	thread_alloc(t);
 
@@ -871,6 +1117,8 @@ int proc_threadCreate(process_t *process, void (*start)(void *), unsigned int *i
 	t->stick = 0;
 	t->utick = 0;
 	t->priority = priority;
+	t->priorityBase = priority;
+	t->priorityBoost = sizeof(threads_common.ready) / sizeof(thread_t *);
 
 	if (process != NULL) {
 		hal_spinlockSet(&threads_common.spinlock);
@@ -881,7 +1129,7 @@ int proc_threadCreate(process_t *process, void (*start)(void *), unsigned int *i
 	t->execdata = NULL;
 
 	/* Insert thread to global quee */
-	proc_lockSet(&threads_common.lock);
+	proc_rwLockWrite(&threads_common.lock);
 	lib_rbInsert(&threads_common.id, &t->idlinkage);
 
 	/* Prepare initial stack */
@@ -909,7 +1157,7 @@ int proc_threadCreate(process_t *process, void (*start)(void *), unsigned int *i
 	LIST_ADD(&threads_common.ready[priority], t);
 	hal_spinlockClear(&threads_common.spinlock);
 
-	proc_lockClear(&threads_common.lock);
+	proc_rwLockClear(&threads_common.lock);
 
 	return EOK;
 }
@@ -926,14 +1174,11 @@ static void _thread_interrupt(thread_t *t)
 void proc_threadEnd(void)
 {
 	thread_t *t;
-	int cpu;
 
 	hal_spinlockSet(&threads_common.spinlock);
-	cpu = hal_cpuGetID();
-	t = threads_common.current[cpu];
-	threads_common.current[cpu] = NULL;
-	LIST_ADD(&threads_common.ghosts, t);
-	_proc_threadWakeup(&threads_common.reaper);
+	t = _proc_current();
+	hal_cpuSetCurrent(NULL);
+	_threads_ghostAdd(t);
 	hal_cpuReschedule(&threads_common.spinlock);
 }
 
@@ -991,12 +1236,13 @@ static void _proc_threadDequeue(thread_t *t)
 
 	t->wakeup = 0;
 	t->wait = NULL;
+	t->waitlock = NULL;
 	t->state = READY;
 	t->interruptible = 0;
 
 	/* MOD */
-	if (t != threads_common.current[hal_cpuGetID()])
-		LIST_ADD(&threads_common.ready[t->priority], t);
+	if (t != _proc_current())
+		_threads_readyAdd(t, 1);
 }
 
 
@@ -1010,7 +1256,7 @@ static void _proc_threadEnqueue(thread_t **queue, time_t timeout, int interrupti
 		return;
 	}
 
-	current = threads_common.current[hal_cpuGetID()];
+	current = _proc_current();
 
 	LIST_ADD(queue, current);
 
@@ -1056,7 +1302,7 @@ int proc_threadSleep(unsigned long long us)
 
 	now = _threads_getTimer();
 
-	current = threads_common.current[hal_cpuGetID()];
+	current = _proc_current();
 	current->state = SLEEP;
 	current->wait = NULL;
 	current->wakeup = now + TIMER_US2CYC(us);
@@ -1105,6 +1351,20 @@ int proc_threadWaitInterruptible(thread_t **queue, spinlock_t *spinlock, time_t
 }
 
 
+int proc_threadWaitUntil(thread_t **queue, spinlock_t *spinlock, time_t deadline)
+{
+	time_t now;
+
+	if (!deadline)
+		return proc_threadWaitEx(queue, spinlock, 0, 1);
+
+	if ((now = proc_uptime()) >= deadline)
+		return -ETIME;
+
+	return proc_threadWaitEx(queue, spinlock, deadline - now, 1);
+}
+
+
 static void _proc_threadWakeup(thread_t **queue)
 {
 	if (*queue != NULL && *queue != (void *)-1)
@@ -1129,6 +1389,73 @@ int proc_threadWakeup(thread_t **queue)
 }
 
 
+/* Wakes up first thread from queue and marks it as next to run, it stays at tail of its ready queue until switch happens */
+static void _proc_threadHandoff(thread_t **queue)
+{
+	thread_t *t, *current;
+
+	if (*queue == NULL || *queue == (void *)-1) {
+		*queue = (void *)-1;
+		return;
+	}
+
+	_proc_threadDequeue(t = *queue);
+
+	if ((current = _proc_current()) == NULL || t->dl.runtime)
+		return;
+
+	current->handoff = t;
+}
+
+
+int proc_threadWaitHandoff(thread_t **queue, spinlock_t *spinlock, thread_t **wakeq, time_t timeout)
+{
+	thread_t *current;
+	int err;
+
+	hal_spinlockSet(&threads_common.spinlock);
+	_proc_threadHandoff(wakeq);
+	_proc_threadEnqueue(queue, timeout, 1);
+
+	if (*queue == NULL) {
+		current = _proc_current();
+		current->handoff = NULL;
+		hal_spinlockClear(&threads_common.spinlock);
+		return EOK;
+	}
+
+	hal_spinlockClear(&threads_common.spinlock);
+	err = hal_cpuReschedule(spinlock);
+	hal_spinlockSet(spinlock);
+
+	return err;
+}
+
+
+void proc_threadWakeupHandoff(thread_t **queue, spinlock_t *spinlock)
+{
+	thread_t *current;
+
+	hal_spinlockSet(&threads_common.spinlock);
+	_proc_threadHandoff(queue);
+
+	current = _proc_current();
+
+	/* Current thread keeps running if woken up one is less important */
+	if (current != NULL && current->handoff != NULL && current->handoff->priority > current->priority)
+		current->handoff = NULL;
+
+	if (current == NULL || current->handoff == NULL) {
+		hal_spinlockClear(&threads_common.spinlock);
+		hal_spinlockClear(spinlock);
+		return;
+	}
+
+	hal_spinlockClear(&threads_common.spinlock);
+	hal_cpuReschedule(spinlock);
+}
+
+
 int proc_threadBroadcast(thread_t **queue)
 {
 	int ret = 0;
@@ -1313,19 +1640,274 @@ int threads_sigpost(process_t *process, thread_t *thread, int sig)
 }
 
 
+/*
+ * Priority inheritance
+ */
+
+
+static unsigned int _lock_priority(lock_t *lock)
+{
+	thread_t *t;
+	unsigned int priority = sizeof(threads_common.ready) / sizeof(thread_t *);
+
+	if ((t = lock->queue) != NULL && t != (void *)-1) {
+		do {
+			if (t->priority < priority)
+				priority = t->priority;
+		}
+		while ((t = t->next) != lock->queue);
+	}
+
+	return priority;
+}
+
+
+static thread_t *_lock_waiter(lock_t *lock)
+{
+	thread_t *t, *w;
+
+	/* Pick the first of the highest priority waiters */
+	if ((w = t = lock->queue) != NULL) {
+		while ((t = t->next) != lock->queue) {
+			if (t->priority < w->priority)
+				w = t;
+		}
+	}
+
+	return w;
+}
+
+
+static void _thread_setPriority(thread_t *t, unsigned int priority)
+{
+	/* Deadline threads are queued by deadline, not priority */
+	if (t->state == READY && t != _proc_current() && !t->dl.runtime) {
+		LIST_REMOVE(&threads_common.ready[t->priority], t);
+		LIST_ADD(&threads_common.ready[priority], t);
+	}
+
+	t->priority = priority;
+}
+
+
+/* Recalculates inherited priority of t and propagates it along the chain of lock owners */
+static void _threads_priorityUpdate(thread_t *t)
+{
+	lock_t *l;
+	unsigned int priority, boost;
+
+	while (t != NULL) {
+		priority = t->priorityBase;
+
+		if (t->priorityBoost < priority)
+			priority = t->priorityBoost;
+
+		hal_spinlockSet(&t->locksSpinlock);
+		if ((l = t->locks) != NULL) {
+			do {
+				if (l->priority < priority)
+					priority = l->priority;
+			}
+			while ((l = l->next) != t->locks);
+		}
+		hal_spinlockClear(&t->locksSpinlock);
+
+		if (priority == t->priority)
+			break;
+
+		boost = priority < t->priority;
+		_thread_setPriority(t, priority);
+
+		if (boost)
+			_perf_priority(t);
+
+		if ((l = t->waitlock) == NULL)
+			break;
+
+		l->priority = _lock_priority(l);
+		t = (thread_t *)l->owner;
+	}
+}
+
+
+static void _threads_locksDetach(thread_t *t)
+{
+	lock_t *l;
+
+	hal_spinlockSet(&t->locksSpinlock);
+	while ((l = t->locks) != NULL) {
+		LIST_REMOVE(&t->locks, l);
+		l->owner = NULL;
+	}
+	hal_spinlockClear(&t->locksSpinlock);
+}
+
+
+int proc_threadPriority(int priority)
+{
+	thread_t *current;
+
+	if (priority < 0 || priority >= sizeof(threads_common.ready) / sizeof(thread_t *))
+		return -EINVAL;
+
+	hal_spinlockSet(&threads_common.spinlock);
+	current = _proc_current();
+	current->priorityBase = priority;
+	_threads_priorityUpdate(current);
+	hal_spinlockClear(&threads_common.spinlock);
+
+	return priority;
+}
+
+
+void proc_threadBoost(int priority)
+{
+	thread_t *current;
+
+	if (priority < 0 || priority >= sizeof(threads_common.ready) / sizeof(thread_t *))
+		priority = sizeof(threads_common.ready) / sizeof(thread_t *);
+
+	hal_spinlockSet(&threads_common.spinlock);
+	if ((current = _proc_current()) != NULL && current->priorityBoost != priority) {
+		current->priorityBoost = priority;
+		_threads_priorityUpdate(current);
+	}
+	hal_spinlockClear(&threads_common.spinlock);
+}
+
+
 /*
  * Locks
  */
 
 
+static void _lock_link(thread_t *t, lock_t *lock)
+{
+	hal_spinlockSet(&t->locksSpinlock);
+	LIST_ADD(&t->locks, lock);
+	hal_spinlockClear(&t->locksSpinlock);
+}
+
+
+static void _lock_unlink(thread_t *t, lock_t *lock)
+{
+	hal_spinlockSet(&t->locksSpinlock);
+	LIST_REMOVE(&t->locks, lock);
+	hal_spinlockClear(&t->locksSpinlock);
+}
+
+
+/* Returns 1 if lock has no waiters and doesn't lend any priority to its owner */
+static int _lock_uncontended(lock_t *lock)
+{
+	return (lock->queue == NULL || lock->queue == (void *)-1) && lock->priority == sizeof(threads_common.ready) / sizeof(thread_t *);
+}
+
+
+static void _lock_acquired(lock_t *lock)
+{
+	thread_t *current;
+
+	lock->v = 0;
+
+	if ((current = proc_current()) == NULL)
+		return;
+
+	lock->owner = current;
+
+	/* Lock without waiters doesn't change owner's priority, scheduler isn't involved */
+	if (lock->queue == NULL || lock->queue == (void *)-1) {
+		lock->priority = sizeof(threads_common.ready) / sizeof(thread_t *);
+		_lock_link(current, lock);
+		return;
+	}
+
+	hal_spinlockSet(&threads_common.spinlock);
+	lock->priority = _lock_priority(lock);
+	_lock_link(current, lock);
+	_threads_priorityUpdate(current);
+	hal_spinlockClear(&threads_common.spinlock);
+}
+
+
+/* Spins while lock owner runs on other CPU, returns 1 if lock has been released */
+static int _lock_spin(lock_t *lock)
+{
+	volatile thread_t *owner;
+	unsigned int i, n, backoff = 1;
+	int running;
+
+	if (hal_cpuGetCount() < 2)
+		return 0;
+
+	hal_spinlockClear(&lock->spinlock);
+
+	for (i = 0; i < LOCK_SPIN_MAX && lock->v == 0; i += n) {
+		__atomic_add_fetch(&threads_common.spinners, 1, __ATOMIC_SEQ_CST);
+		owner = __atomic_load_n(&lock->owner, __ATOMIC_SEQ_CST);
+		running = (owner != NULL && owner->running);
+		__atomic_sub_fetch(&threads_common.spinners, 1, __ATOMIC_SEQ_CST);
+
+		if (!running)
+			break;
+
+		for (n = 0; n < backoff && lock->v == 0; n++)
+			;
+
+		if (backoff < LOCK_BACKOFF_MAX)
+			backoff <<= 1;
+	}
+
+	hal_spinlockSet(&lock->spinlock);
+
+	return lock->v != 0;
+}
+
+
 int _proc_lockSet(lock_t *lock, int interruptible)
 {
+	thread_t *current;
+	int err;
+
 	while (lock->v == 0) {
-		if (proc_threadWaitEx(&lock->queue, &lock->spinlock, 0, interruptible) == -EINTR)
+		/* Short critical section of owner running on other CPU isn't worth a context switch */
+		if (_lock_spin(lock))
+			continue;
+
+		hal_spinlockSet(&threads_common.spinlock);
+		_proc_threadEnqueue(&lock->queue, 0, interruptible);
+
+		if (lock->queue == NULL) {
+			hal_spinlockClear(&threads_common.spinlock);
+			continue;
+		}
+
+		/* Lend our priority to the lock holder */
+		current = _proc_current();
+		current->waitlock = lock;
+
+		if (current->priority < lock->priority) {
+			lock->priority = current->priority;
+			_threads_priorityUpdate((thread_t *)lock->owner);
+		}
+
+		hal_spinlockClear(&threads_common.spinlock);
+
+		err = hal_cpuReschedule(&lock->spinlock);
+		hal_spinlockSet(&lock->spinlock);
+
+		if (err == -EINTR) {
+			/* Take back priority lent to the lock holder */
+			hal_spinlockSet(&threads_common.spinlock);
+			lock->priority = _lock_priority(lock);
+			_threads_priorityUpdate((thread_t *)lock->owner);
+			hal_spinlockClear(&threads_common.spinlock);
+
 			return -EINTR;
+		}
 	}
 
-	lock->v = 0;
+	_lock_acquired(lock);
 	return EOK;
 }
 
@@ -1365,8 +1947,8 @@ int proc_lockTry(lock_t *lock)
 	hal_spinlockSet(&lock->spinlock);
 	if (lock->v == 0)
 		err = -EBUSY;
-
-	lock->v = 0;
+	else
+		_lock_acquired(lock);
 	hal_spinlockClear(&lock->spinlock);
 
 	return err;
@@ -1375,12 +1957,37 @@ int proc_lockTry(lock_t *lock)
 
 int _proc_lockClear(lock_t *lock)
 {
-	lock->v = 1;
-	if (lock->queue == NULL || lock->queue == (void *)-1)
+	thread_t *owner;
+	int ret = 0;
+
+	/* Waiters enqueue only with lock->spinlock held, uncontended release skips scheduler */
+	if (_lock_uncontended(lock)) {
+		if ((owner = (thread_t *)lock->owner) != NULL) {
+			_lock_unlink(owner, lock);
+			lock->owner = NULL;
+		}
+		lock->v = 1;
+
 		return 0;
+	}
+
+	hal_spinlockSet(&threads_common.spinlock);
+	lock->v = 1;
+
+	/* Drop priority inherited through this lock */
+	if ((owner = (thread_t *)lock->owner) != NULL) {
+		_lock_unlink(owner, lock);
+		lock->owner = NULL;
+		_threads_priorityUpdate(owner);
+	}
+
+	if (lock->queue != NULL && lock->queue != (void *)-1) {
+		_proc_threadDequeue(_lock_waiter(lock));
+		ret = 1;
+	}
+	hal_spinlockClear(&threads_common.spinlock);
 
-	proc_threadWakeup(&lock->queue);
-	return 1;
+	return ret;
 }
 
 
@@ -1418,21 +2025,75 @@ int proc_lockSet2(lock_t *l1, lock_t *l2)
 
 int proc_lockWait(thread_t **queue, lock_t *lock, time_t timeout)
 {
+	thread_t *current = proc_current();
 	int err;
 	hal_spinlockSet(&lock->spinlock);
 	_proc_lockClear(lock);
+	current->relock = lock;
 	if ((err = proc_threadWaitEx(queue, &lock->spinlock, timeout, 1)) != -EINTR)
 		_proc_lockSet(lock, 0);
+	current->relock = NULL;
 	hal_spinlockClear(&lock->spinlock);
 	return err;
 }
 
 
+void proc_lockBroadcast(thread_t **queue)
+{
+	thread_t *t;
+	lock_t *lock;
+
+	hal_spinlockSet(&threads_common.spinlock);
+	if (*queue == (void *)-1 || *queue == NULL) {
+		*queue = (void *)(-1);
+		hal_spinlockClear(&threads_common.spinlock);
+		return;
+	}
+
+	/* Wake up only one waiter, it contends for the lock on behalf of the others */
+	t = *queue;
+	lock = t->relock;
+	_proc_threadDequeue(t);
+
+	/* Lock queue is changed here without lock->spinlock, it's safe only if caller holds the lock */
+	if (lock != NULL && (lock->queue == (void *)-1 || lock->owner != _proc_current()))
+		lock = NULL;
+
+	/* Move remaining waiters onto the lock queue, each lock release wakes up the next one */
+	while ((t = *queue) != NULL) {
+		if (lock == NULL || t->relock != lock) {
+			_proc_threadDequeue(t);
+			continue;
+		}
+
+		LIST_REMOVE(queue, t);
+
+		if (t->wakeup)
+			lib_rbRemove(&threads_common.sleeping, &t->sleeplinkage);
+
+		LIST_ADD(&lock->queue, t);
+		t->wakeup = 0;
+		t->wait = &lock->queue;
+		t->waitlock = lock;
+		t->interruptible = 0;
+	}
+
+	if (lock != NULL) {
+		lock->priority = _lock_priority(lock);
+		_threads_priorityUpdate((thread_t *)lock->owner);
+	}
+
+	hal_cpuReschedule(&threads_common.spinlock);
+}
+
+
 int proc_lockInit(lock_t *lock)
 {
 	lock->owner = NULL;
-	lock->priority = 0;
+	lock->priority = sizeof(threads_common.ready) / sizeof(thread_t *);
 	lock->queue = NULL;
+	lock->next = NULL;
+	lock->prev = NULL;
 	lock->v = 1;
 	hal_spinlockCreate(&lock->spinlock, "lock.spinlock");
 	return EOK;
@@ -1441,6 +2102,16 @@ int proc_lockInit(lock_t *lock)
 
 int proc_lockDone(lock_t *lock)
 {
+	thread_t *owner;
+
+	hal_spinlockSet(&threads_common.spinlock);
+	if ((owner = (thread_t *)lock->owner) != NULL) {
+		_lock_unlink(owner, lock);
+		lock->owner = NULL;
+		_threads_priorityUpdate(owner);
+	}
+	hal_spinlockClear(&threads_common.spinlock);
+
 	hal_spinlockDestroy(&lock->spinlock);
 	return EOK;
 }
@@ -1505,7 +2176,7 @@ int proc_threadsList(int n, threadinfo_t *info)
 	time_t now;
 	char *name;
 
-	proc_lockSet(&threads_common.lock);
+	proc_rwLockRead(&threads_common.lock);
 
 	t = lib_treeof(thread_t, idlinkage, lib_rbMinimum(threads_common.id.root));
 
@@ -1576,21 +2247,21 @@ int proc_threadsList(int n, threadinfo_t *info)
 		info[i].vmem = 0;
 
 		if (map != NULL) {
-			proc_lockSet(&map->lock);
+			proc_rwLockRead(&map->lock);
 			entry = lib_treeof(map_entry_t, linkage, lib_rbMinimum(map->tree.root));
 
 			while (entry != NULL) {
 				info[i].vmem += entry->size;
 				entry = lib_treeof(map_entry_t, linkage, lib_rbNext(&entry->linkage));
 			}
-			proc_lockClear(&map->lock);
+			proc_rwLockClear(&map->lock);
 		}
 
 		++i;
 		t = lib_treeof(thread_t, idlinkage, lib_rbNext(&t->idlinkage));
 	}
 
-	proc_lockClear(&threads_common.lock);
+	proc_rwLockClear(&threads_common.lock);
 
 	return i;
 }
@@ -1604,12 +2275,13 @@ int _threads_init(vm_map_t *kmap, vm_object_t *kernel)
 	threads_common.jiffies = 0;
 	threads_common.ghosts = NULL;
 	threads_common.reaper = NULL;
+	threads_common.spinners = 0;
 	threads_common.utcoffs = 0;
 	threads_common.idcounter = 0;
 
 	threads_common.perfGather = 0;
 
-	proc_lockInit(&threads_common.lock);
+	proc_rwLockInit(&threads_common.lock);
 
 #ifndef CPU_STM32
 	hal_memset(&threads_common.load, 0, sizeof(threads_common.load));
@@ -1620,21 +2292,20 @@ int _threads_init(vm_map_t *kmap, vm_object_t *kernel)
 		threads_common.ready[i] = NULL;
 
 	lib_rbInit(&threads_common.sleeping, threads_sleepcmp, NULL);
+	lib_rbInit(&threads_common.dlready, threads_dlcmp, NULL);
+	threads_common.dlthrottled = NULL;
+	threads_common.dlutil = 0;
 	lib_rbInit(&threads_common.id, threads_idcmp, thread_augment);
 
 	lib_printf("proc: Initializing thread scheduler, priorities=%d\n", sizeof(threads_common.ready) / sizeof(thread_t *));
 
 	hal_spinlockCreate(&threads_common.spinlock, "threads.spinlock");
 
-	/* Allocate and initialize current threads array */
-	if ((threads_common.current = (thread_t **)vm_kmalloc(sizeof(thread_t *) * hal_cpuGetCount())) == NULL)
-		return -ENOMEM;
+	hal_cpuSetCurrent(NULL);
 
 	/* Run idle thread on every cpu */
-	for (i = 0; i < hal_cpuGetCount(); i++) {
-		threads_common.current[i] = NULL;
+	for (i = 0; i < hal_cpuGetCount(); i++)
 		proc_threadCreate(NULL, threads_idlethr, NULL, sizeof(threads_common.ready) / sizeof(thread_t *) - 1, SIZE_KSTACK, NULL, 0, NULL);
-	}
 
 	/* Install scheduler on clock interrupt */
 #ifdef PENDSV_IRQ
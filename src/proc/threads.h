@@ -42,6 +42,22 @@ typedef struct {
 } cpu_load_t;
 
 
+/* Deadline scheduling class parameters and state, times in timer cycles */
+typedef struct {
+	time_t runtime;
+	time_t deadline;
+	time_t period;
+
+	time_t budget;
+	time_t release;
+	time_t absdeadline;
+	time_t dispatched;
+
+	unsigned int util;
+	rbnode_t linkage;
+} thread_dl_t;
+
+
 typedef struct _thread_t {
 	struct _thread_t *next;
 	struct _thread_t *prev;
@@ -61,8 +77,20 @@ typedef struct _thread_t {
 
 	struct _thread_t **wait;
 	volatile time_t wakeup;
+	volatile unsigned char running;
+	struct _thread_t *handoff;
+
+	/* Priority inheritance, list of held locks is synchronized by locksSpinlock */
+	lock_t *locks;
+	lock_t *waitlock;
+	spinlock_t locksSpinlock;
+
+	/* Lock reacquired after conditional wait, broadcast requeues the thread on it */
+	lock_t *relock;
 
 	unsigned priority : 4;
+	unsigned priorityBase : 4;
+	unsigned priorityBoost : 4;
 	unsigned exit : 1;
 	unsigned state : 1;
 	unsigned interruptible : 1;
@@ -83,6 +111,9 @@ typedef struct _thread_t {
 	time_t readyTime;
 	time_t maxWait;
 
+	/* Deadline class, fixed priority if dl.runtime == 0 */
+	thread_dl_t dl;
+
 #ifndef CPU_STM32
 	cpu_load_t load;
 #endif
@@ -124,6 +155,16 @@ extern void proc_threadUnprotect(void);
 extern void proc_threadEnd(void);
 
 
+extern int proc_threadPriority(int priority);
+
+
+/* Raises current thread priority while it serves a message, negative value drops the boost */
+extern void proc_threadBoost(int priority);
+
+
+extern int proc_threadDeadline(time_t runtime, time_t deadline, time_t period);
+
+
 extern int proc_threadJoin(unsigned int id);
 
 
@@ -154,9 +195,21 @@ extern int proc_threadWait(thread_t **queue, spinlock_t *spinlock, time_t timeou
 extern int proc_threadWaitInterruptible(thread_t **queue, spinlock_t *spinlock, time_t timeout);
 
 
+/* Waits interruptibly until deadline given in uptime microseconds, 0 means no deadline */
+extern int proc_threadWaitUntil(thread_t **queue, spinlock_t *spinlock, time_t deadline);
+
+
 extern int proc_threadWakeup(thread_t **queue);
 
 
+/* Wakes up a thread waiting on wakeq, switches directly to it and waits on queue */
+extern int proc_threadWaitHandoff(thread_t **queue, spinlock_t *spinlock, thread_t **wakeq, time_t timeout);
+
+
+/* Wakes up a thread waiting on queue and switches directly to it, releases spinlock */
+extern void proc_threadWakeupHandoff(thread_t **queue, spinlock_t *spinlock);
+
+
 extern void proc_threadWakeupYield(thread_t **queue);
 
 
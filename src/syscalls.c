@@ -85,11 +85,18 @@ void syscalls_munmap(void *ustack)
 {
 	void *vaddr;
 	size_t size;
+	vm_map_t *map = proc_current()->process->mapp;
 
 	GETFROMSTACK(ustack, void *, vaddr, 0);
 	GETFROMSTACK(ustack, size_t, size, 1);
 
-	vm_munmap(proc_current()->process->mapp, vaddr, size);
+#ifndef NOMMU
+	/* Kernel keeps using receive windows, they can't be unmapped (mmap never replaces existing entries) */
+	if (proc_msgWindow(map, vaddr, size))
+		return;
+#endif
+
+	vm_munmap(map, vaddr, size);
 }
 
 
@@ -249,11 +256,21 @@ int syscalls_priority(void *ustack)
 	thread = proc_current();
 
 	if (priority == -1)
-		return thread->priority;
-	else if (priority >= 0 && priority <= 7)
-		return thread->priority = priority;
+		return thread->priorityBase;
+
+	return proc_threadPriority(priority);
+}
+
+
+int syscalls_threadDeadline(void *ustack)
+{
+	time_t runtime, deadline, period;
+
+	GETFROMSTACK(ustack, time_t, runtime, 0);
+	GETFROMSTACK(ustack, time_t, deadline, 1);
+	GETFROMSTACK(ustack, time_t, period, 2);
 
-	return -EINVAL;
+	return proc_threadDeadline(runtime, deadline, period);
 }
 
 
@@ -440,6 +457,32 @@ int syscalls_condBroadcast(void *ustack)
 }
 
 
+int syscalls_futexWait(void *ustack)
+{
+	u32 *addr;
+	u32 val;
+	time_t timeout;
+
+	GETFROMSTACK(ustack, u32 *, addr, 0);
+	GETFROMSTACK(ustack, u32, val, 1);
+	GETFROMSTACK(ustack, time_t, timeout, 2);
+
+	return proc_futexWait(addr, val, timeout);
+}
+
+
+int syscalls_futexWake(void *ustack)
+{
+	u32 *addr;
+	unsigned int n;
+
+	GETFROMSTACK(ustack, u32 *, addr, 0);
+	GETFROMSTACK(ustack, unsigned int, n, 1);
+
+	return proc_futexWake(addr, n);
+}
+
+
 /*
  * Resources
  */
@@ -508,6 +551,40 @@ void syscalls_portDestroy(void *ustack)
 }
 
 
+int syscalls_portSetAdd(void *ustack)
+{
+	u32 set, port;
+
+	GETFROMSTACK(ustack, u32, set, 0);
+	GETFROMSTACK(ustack, u32, port, 1);
+
+	return proc_portSetAdd(set, port);
+}
+
+
+int syscalls_portSetRemove(void *ustack)
+{
+	u32 set, port;
+
+	GETFROMSTACK(ustack, u32, set, 0);
+	GETFROMSTACK(ustack, u32, port, 1);
+
+	return proc_portSetRemove(set, port);
+}
+
+
+int syscalls_portsinfo(void *ustack)
+{
+	int n;
+	portinfo_t *info;
+
+	GETFROMSTACK(ustack, int, n, 0);
+	GETFROMSTACK(ustack, portinfo_t *, info, 1);
+
+	return proc_portsList(n, info);
+}
+
+
 u32 syscalls_portRegister(void *ustack)
 {
 	unsigned int port;
@@ -562,6 +639,123 @@ int syscalls_msgRespond(void *ustack)
 }
 
 
+int syscalls_msgRespondAndRecv(void *ustack)
+{
+	u32 port;
+	msg_t *msg;
+	unsigned int *rid;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, msg_t *, msg, 1);
+	GETFROMSTACK(ustack, unsigned int *, rid, 2);
+
+	return proc_respondAndRecv(port, msg, rid);
+}
+
+
+int syscalls_msgSendTimed(void *ustack)
+{
+	u32 port;
+	msg_t *msg;
+	time_t timeout;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, msg_t *, msg, 1);
+	GETFROMSTACK(ustack, time_t, timeout, 2);
+
+	return proc_sendTimed(port, msg, timeout);
+}
+
+
+int syscalls_msgRecvTimed(void *ustack)
+{
+	u32 port;
+	msg_t *msg;
+	unsigned int *rid;
+	time_t timeout;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, msg_t *, msg, 1);
+	GETFROMSTACK(ustack, unsigned int *, rid, 2);
+	GETFROMSTACK(ustack, time_t, timeout, 3);
+
+	return proc_recvTimed(port, msg, rid, timeout);
+}
+
+
+int syscalls_msgSendv(void *ustack)
+{
+	u32 port;
+	msg_t *msg;
+	msgiov_t *iiov, *oiov;
+	unsigned int iiovcnt, oiovcnt;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, msg_t *, msg, 1);
+	GETFROMSTACK(ustack, msgiov_t *, iiov, 2);
+	GETFROMSTACK(ustack, unsigned int, iiovcnt, 3);
+	GETFROMSTACK(ustack, msgiov_t *, oiov, 4);
+	GETFROMSTACK(ustack, unsigned int, oiovcnt, 5);
+
+	return proc_sendv(port, msg, iiov, iiovcnt, oiov, oiovcnt);
+}
+
+
+int syscalls_msgRingSetup(void *ustack)
+{
+	u32 port;
+	unsigned int entries;
+	size_t size;
+	void **vaddr;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, unsigned int, entries, 1);
+	GETFROMSTACK(ustack, size_t, size, 2);
+	GETFROMSTACK(ustack, void **, vaddr, 3);
+
+	return proc_ringSetup(port, entries, size, vaddr);
+}
+
+
+int syscalls_msgRingEnter(void *ustack)
+{
+	unsigned int h;
+	int wait;
+	time_t timeout;
+
+	GETFROMSTACK(ustack, unsigned int, h, 0);
+	GETFROMSTACK(ustack, int, wait, 1);
+	GETFROMSTACK(ustack, time_t, timeout, 2);
+
+	return proc_ringEnter(h, wait, timeout);
+}
+
+
+int syscalls_msgRingComplete(void *ustack)
+{
+	u32 port;
+	unsigned int id;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, unsigned int, id, 1);
+
+	return proc_ringComplete(port, id);
+}
+
+
+int syscalls_msgPulse(void *ustack)
+{
+	u32 port;
+	int code, value;
+
+	GETFROMSTACK(ustack, u32, port, 0);
+	GETFROMSTACK(ustack, int, code, 1);
+	GETFROMSTACK(ustack, int, value, 2);
+
+	return proc_pulse(port, code, value);
+}
+
+
 int syscalls_lookup(void *ustack)
 {
 	char *name;
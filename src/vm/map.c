@@ -355,9 +355,9 @@ static void *_map_map(vm_map_t *map, void *vaddr, process_t *proc, size_t size,
 
 void *vm_mapFind(vm_map_t *map, void *vaddr, size_t size, u8 flags, u8 prot)
 {
-	proc_lockSet(&map->lock);
+	proc_rwLockWrite(&map->lock);
 	vaddr = _map_map(map, vaddr, NULL, size, prot, map_common.kernel, -1, flags, NULL);
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 
 	return vaddr;
 }
@@ -508,9 +508,9 @@ void *vm_mmap(vm_map_t *map, void *vaddr, page_t *p, size_t size, u8 prot, vm_ob
 	if (map == NULL)
 		map = map_common.kmap;
 
-	proc_lockSet(&map->lock);
+	proc_rwLockWrite(&map->lock);
 	vaddr = _vm_mmap(map, vaddr, p, size, prot, o, offs, flags);
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 	return vaddr;
 }
 
@@ -519,11 +519,14 @@ void *vm_mmap(vm_map_t *map, void *vaddr, page_t *p, size_t size, u8 prot, vm_ob
  * Fault routines
  */
 
-int vm_lockVerify(vm_map_t *map, amap_t **amap, vm_object_t *o, void *vaddr, offs_t offs)
+int vm_lockVerify(vm_map_t *map, amap_t **amap, vm_object_t *o, void *vaddr, offs_t offs, int shared)
 {
 	map_entry_t t, *e;
 
-	proc_lockSet(&map->lock);
+	if (shared)
+		proc_rwLockRead(&map->lock);
+	else
+		proc_rwLockWrite(&map->lock);
 
 	t.vaddr = vaddr;
 	t.size = SIZE_PAGE;
@@ -549,7 +552,7 @@ int vm_mapFlags(vm_map_t *map, void *vaddr)
 	int flags;
 	map_entry_t t, *e;
 
-	proc_lockSet(&map->lock);
+	proc_rwLockRead(&map->lock);
 
 	t.vaddr = vaddr;
 	t.size = SIZE_PAGE;
@@ -557,12 +560,12 @@ int vm_mapFlags(vm_map_t *map, void *vaddr)
 	e = lib_treeof(map_entry_t, linkage, lib_rbFind(&map->tree, &t.linkage));
 
 	if (e == NULL) {
-		proc_lockClear(&map->lock);
+		proc_rwLockClear(&map->lock);
 		return -EFAULT;
 	}
 
 	flags = e->flags & ~MAP_NEEDSCOPY;
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 
 	return flags;
 }
@@ -571,22 +574,37 @@ int vm_mapFlags(vm_map_t *map, void *vaddr)
 int vm_mapForce(vm_map_t *map, void *paddr, int prot)
 {
 	map_entry_t t, *e;
-	int err;
+	int err, shared;
 
-	proc_lockSet(&map->lock);
+	/* Kernel map faults create kernel mappings (see amap_map) */
+	shared = (map != map_common.kmap);
 
-	t.vaddr = paddr;
-	t.size = SIZE_PAGE;
+	for (;;) {
+		if (shared)
+			proc_rwLockRead(&map->lock);
+		else
+			proc_rwLockWrite(&map->lock);
 
-	e = lib_treeof(map_entry_t, linkage, lib_rbFind(&map->tree, &t.linkage));
+		t.vaddr = paddr;
+		t.size = SIZE_PAGE;
 
-	if (e == NULL) {
-		proc_lockClear(&map->lock);
-		return -EFAULT;
+		e = lib_treeof(map_entry_t, linkage, lib_rbFind(&map->tree, &t.linkage));
+
+		if (e == NULL) {
+			proc_rwLockClear(&map->lock);
+			return -EFAULT;
+		}
+
+		/* Faults are resolved concurrently unless entry needs a new amap */
+		if (!shared || !((prot & PROT_WRITE && e->flags & MAP_NEEDSCOPY) || (e->object == NULL && e->amap == NULL)))
+			break;
+
+		proc_rwLockClear(&map->lock);
+		shared = 0;
 	}
 
 	err = _map_force(map, e, paddr, prot);
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 	return err;
 }
 
@@ -700,9 +718,9 @@ int vm_munmap(vm_map_t *map, void *vaddr, size_t size)
 {
 	int result;
 
-	proc_lockSet(&map->lock);
+	proc_rwLockWrite(&map->lock);
 	result = _vm_munmap(map, vaddr, size);
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 
 	return result;
 }
@@ -713,9 +731,9 @@ void vm_mapDump(vm_map_t *map)
 	if (map == NULL)
 		map = map_common.kmap;
 
-	proc_lockSet(&map->lock);
+	proc_rwLockRead(&map->lock);
 	lib_rbDump(map->tree.root, map_dump);
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 }
 
 
@@ -736,9 +754,14 @@ int vm_mapCreate(vm_map_t *map, void *start, void *stop)
 	}
 
 	pmap_create(&map->pmap, &map_common.kmap->pmap, map->pmapp, map->pmapv);
+
+	map->msgwin = NULL;
+	map->msgslots = 0;
+	map->msgbuf = NULL;
+	map->msgbufslots = 0;
 #endif
 
-	proc_lockInit(&map->lock);
+	proc_rwLockInit(&map->lock);
 	lib_rbInit(&map->tree, map_cmp, map_augment);
 	return EOK;
 }
@@ -765,18 +788,30 @@ void vm_mapDestroy(process_t *p, vm_map_t *map)
 		_entry_put(map, e);
 	}
 
-	proc_lockDone(&map->lock);
+	proc_rwLockDone(&map->lock);
 #else
-	proc_lockSet(&map->lock);
+	proc_rwLockWrite(&map->lock);
 	while ((e = p->entries) != NULL) {
 		_map_remove(map, e);
 		map_free(e);
 	}
-	proc_lockClear(&map->lock);
+	proc_rwLockClear(&map->lock);
 #endif
 }
 
 
+static void map_lockWrite2(vm_map_t *m1, vm_map_t *m2)
+{
+	proc_rwLockWrite(&m1->lock);
+
+	while (proc_rwLockTryWrite(&m2->lock) < 0) {
+		proc_rwLockClear(&m1->lock);
+		proc_rwLockWrite(&m2->lock);
+		swap(m1, m2);
+	}
+}
+
+
 static void remap_readonly(vm_map_t *map, map_entry_t *e, int offs)
 {
 	addr_t a;
@@ -796,7 +831,7 @@ int vm_mapCopy(process_t *proc, vm_map_t *dst, vm_map_t *src)
 	map_entry_t *e, *f;
 	int offs;
 
-	proc_lockSet2(&src->lock, &dst->lock);
+	map_lockWrite2(src, dst);
 
 	for (n = lib_rbMinimum(src->tree.root); n != NULL; n = lib_rbNext(n)) {
 		e = lib_treeof(map_entry_t, linkage, n);
@@ -805,8 +840,8 @@ int vm_mapCopy(process_t *proc, vm_map_t *dst, vm_map_t *src)
 			continue;
 
 		if ((f = map_alloc()) == NULL) {
-			proc_lockClear(&dst->lock);
-			proc_lockClear(&src->lock);
+			proc_rwLockClear(&dst->lock);
+			proc_rwLockClear(&src->lock);
 			vm_mapDestroy(proc, dst);
 			return -ENOMEM;
 		}
@@ -831,16 +866,16 @@ int vm_mapCopy(process_t *proc, vm_map_t *dst, vm_map_t *src)
 			for (offs = 0; offs < f->size; offs += SIZE_PAGE) {
 				if (_map_force(dst, f, f->vaddr + offs, f->prot) < 0 ||
 				    _map_force(src, e, e->vaddr + offs, e->prot) < 0) {
-					proc_lockClear(&dst->lock);
-					proc_lockClear(&src->lock);
+					proc_rwLockClear(&dst->lock);
+					proc_rwLockClear(&src->lock);
 					return -ENOMEM;
 				}
 			}
 		}
 	}
 
-	proc_lockClear(&dst->lock);
-	proc_lockClear(&src->lock);
+	proc_rwLockClear(&dst->lock);
+	proc_rwLockClear(&src->lock);
 
 	return EOK;
 }
@@ -872,7 +907,7 @@ void vm_mapinfo(meminfo_t *info)
 		}
 
 		if ((map = process->mapp) != NULL) {
-			proc_lockSet(&map->lock);
+			proc_rwLockRead(&map->lock);
 
 #ifndef NOMMU
 			for (size = 0, n = lib_rbMinimum(map->tree.root); n != NULL; n = lib_rbNext(n), ++size) {
@@ -947,7 +982,7 @@ void vm_mapinfo(meminfo_t *info)
 			while (e != process->entries);
 #endif
 
-			proc_lockClear(&map->lock);
+			proc_rwLockClear(&map->lock);
 		}
 		else {
 			size = 0;
@@ -958,7 +993,7 @@ void vm_mapinfo(meminfo_t *info)
 	}
 
 	if (info->entry.kmapsz != -1) {
-		proc_lockSet(&map_common.kmap->lock);
+		proc_rwLockRead(&map_common.kmap->lock);
 
 		for (size = 0, n = lib_rbMinimum(map_common.kmap->tree.root); n != NULL; n = lib_rbNext(n), ++size) {
 			if (info->entry.kmap != NULL && info->entry.kmapsz > size) {
@@ -993,7 +1028,7 @@ void vm_mapinfo(meminfo_t *info)
 			}
 		}
 
-		proc_lockClear(&map_common.kmap->lock);
+		proc_rwLockClear(&map_common.kmap->lock);
 		info->entry.kmapsz = size;
 	}
 }
@@ -1057,9 +1092,16 @@ int _map_init(vm_map_t *kmap, vm_object_t *kernel, void **bss, void **top)
 	kmap->start = kmap->pmap.start;
 	kmap->stop = kmap->pmap.end;
 
-	proc_lockInit(&kmap->lock);
+	proc_rwLockInit(&kmap->lock);
 	lib_rbInit(&kmap->tree, map_cmp, map_augment);
 
+#ifndef NOMMU
+	kmap->msgwin = NULL;
+	kmap->msgslots = 0;
+	kmap->msgbuf = NULL;
+	kmap->msgbufslots = 0;
+#endif
+
 	map_common.kmap = kmap;
 	map_common.kernel = kernel;
 
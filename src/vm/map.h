@@ -22,6 +22,7 @@
 #include "../lib/lib.h"
 #include "object.h"
 #include "proc/lock.h"
+#include "proc/rwlock.h"
 #include "vm/amap.h"
 
 
@@ -34,11 +35,17 @@ typedef struct _vm_map_t {
 	void *start;
 	void *stop;
 	rbtree_t tree;
-	lock_t lock;
+	rwlock_t lock;
 
 #ifndef NOMMU	
 	void *pmapv;
 	page_t *pmapp;
+
+	/* IPC receive window, slots are allocated by proc/msg.c */
+	void *msgwin;
+	u32 msgslots;
+	void *msgbuf;
+	u32 msgbufslots;
 #endif
 } vm_map_t;
 
@@ -91,7 +98,7 @@ extern int vm_mapForce(vm_map_t *map, void *vaddr, int prot);
 extern int vm_mapFlags(vm_map_t *map, void *vaddr);
 
 
-extern int vm_lockVerify(vm_map_t *map, struct _amap_t **amap, struct _vm_object_t *o, void *vaddr, offs_t offs);
+extern int vm_lockVerify(vm_map_t *map, struct _amap_t **amap, struct _vm_object_t *o, void *vaddr, offs_t offs, int shared);
 
 
 extern int vm_munmap(vm_map_t *map, void *vaddr, size_t size);
@@ -167,6 +167,7 @@ static page_t *object_fetch(oid_t oid, offs_t offs)
 page_t *vm_objectPage(vm_map_t *map, amap_t **amap, vm_object_t *o, void *vaddr, offs_t offs)
 {
 	page_t *p;
+	int shared;
 
 	if (o == NULL)
 		return vm_pageAlloc(SIZE_PAGE, PAGE_OWNER_APP);
@@ -193,11 +194,13 @@ page_t *vm_objectPage(vm_map_t *map, amap_t **amap, vm_object_t *o, void *vaddr,
 	if (amap != NULL)
 		proc_lockClear(&(*amap)->lock);
 
-	proc_lockClear(&map->lock);
+	/* Map lock is held exclusively by writer only */
+	shared = !map->lock.writer;
+	proc_rwLockClear(&map->lock);
 
 	p = object_fetch(o->oid, offs);
 
-	if (vm_lockVerify(map, amap, o, vaddr, offs)) {
+	if (vm_lockVerify(map, amap, o, vaddr, offs, shared)) {
 		if (p != NULL)
 			vm_pageFree(p);
 